@@ -2,12 +2,14 @@
 
 # IS_DEBUG=""
 PORT=""
-while getopts p: OPT
+IS_UNIX=""
+while getopts p:u OPT
 do
     case $OPT in
         p) PORT="-p ${OPTARG}";;
+        u) IS_UNIX="-u";;
     esac
 done
 
 cd simulator || exit 1
-rlwrap ./server $PORT || exit 1
+rlwrap ./server $PORT $IS_UNIX || exit 1
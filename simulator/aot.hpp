@@ -0,0 +1,223 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <sim.hpp>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+
+/*
+    AOT(事前)変換
+    - op_listをC++のソースコード(PCごとにラベルを1つ持ち、jalrの飛び先だけをswitchで求めるもの)に変換し、
+      g++でコンパイルして単体で動くバイナリにする
+    - 生成されたコードはfpu.hppのFpuとunit.hppのReg/Memory/TransmissionQueueをそのまま使うので、実行結果はシミュレータと一致する
+    - siによる自己書き換えを含むプログラムは変換できないので、その場合はインタプリタでの実行に戻る
+*/
+
+extern std::string head;
+extern std::string filename;
+extern int mem_size;
+extern bool is_preloading;
+extern std::string preload_filename;
+extern bool is_raytracing;
+
+// 命令1つ分のコード
+inline std::string aot_code_of_op(const Operation& op, unsigned int id){
+    std::stringstream ss;
+    std::string rd = std::to_string(op.rd);
+    std::string rs1 = std::to_string(op.rs1);
+    std::string rs2 = std::to_string(op.rs2);
+    std::string imm = std::to_string(op.imm);
+    // 飛び先 (範囲外ならL_endへ)
+    auto jump = [&](unsigned int target){
+        if(target < code_size) return "goto L_" + std::to_string(target) + ";";
+        return "{ pc = " + std::to_string(target) + "u; goto L_end; }";
+    };
+    auto binop_int = [&](const std::string& e){ return "reg_int.write_int(" + rd + ", " + e + ");"; };
+    auto fp_op = [&](const std::string& e_ieee, const std::string& e_fpu){
+        return is_ieee ? "reg_fp.write_float(" + rd + ", " + e_ieee + ");" : "reg_fp.write_32(" + rd + ", " + e_fpu + ");";
+    };
+    std::string a_int = "reg_int.read_int(" + rs1 + ")";
+    std::string b_int = "reg_int.read_int(" + rs2 + ")";
+    std::string a_f = "reg_fp.read_float(" + rs1 + ")";
+    std::string b_f = "reg_fp.read_float(" + rs2 + ")";
+    std::string a_32 = "reg_fp.read_32(" + rs1 + ")";
+    std::string b_32 = "reg_fp.read_32(" + rs2 + ")";
+
+    switch(op.type){
+        case o_add: ss << binop_int(a_int + " + " + b_int); break;
+        case o_sub: ss << binop_int(a_int + " - " + b_int); break;
+        case o_sll: ss << binop_int(a_int + " << " + b_int); break;
+        case o_srl: ss << binop_int("static_cast<unsigned int>(" + a_int + ") >> " + b_int); break;
+        case o_sra: ss << binop_int(a_int + " >> " + b_int); break;
+        case o_and: ss << binop_int(a_int + " & " + b_int); break;
+        case o_fabs: ss << fp_op("std::abs(" + a_f + ")", "fpu.fabs(" + a_32 + ")"); break;
+        case o_fneg: ss << fp_op("- " + a_f, "fpu.fneg(" + a_32 + ")"); break;
+        case o_fdiv: ss << fp_op(a_f + " / " + b_f, "fpu.fdiv(" + a_32 + ", " + b_32 + ")"); break;
+        case o_fsqrt: ss << fp_op("std::sqrt(" + a_f + ")", "fpu.fsqrt(" + a_32 + ")"); break;
+        case o_fcvtif: ss << fp_op("static_cast<float>(reg_fp.read_int(" + rs1 + "))", "fpu.itof(" + a_32 + ")"); break;
+        case o_fcvtfi: ss << fp_op("static_cast<int>(std::nearbyint(" + a_f + "))", "fpu.ftoi(" + a_32 + ")"); break;
+        case o_fmvff: ss << "reg_fp.write_32(" << rd << ", " << a_32 << ");"; break;
+        case o_fadd: ss << fp_op(a_f + " + " + b_f, "fpu.fadd(" + a_32 + ", " + b_32 + ")"); break;
+        case o_fsub: ss << fp_op(a_f + " - " + b_f, "fpu.fsub(" + a_32 + ", " + b_32 + ")"); break;
+        case o_fmul: ss << fp_op(a_f + " * " + b_f, "fpu.fmul(" + a_32 + ", " + b_32 + ")"); break;
+        case o_beq: ss << "if(" << a_int << " == " << b_int << ") " << jump(id + op.imm); break;
+        case o_blt: ss << "if(" << a_int << " < " << b_int << ") " << jump(id + op.imm); break;
+        case o_fbeq: ss << "if(" << a_f << " == " << b_f << ") " << jump(id + op.imm); break;
+        case o_fblt: ss << "if(" << a_f << " < " << b_f << ") " << jump(id + op.imm); break;
+        case o_sw: ss << "memory.write(reg_int.read_int(" << rs1 << ") + " << imm << ", reg_int.read_32(" << rs2 << "));"; break;
+        case o_std: ss << "send_buffer.push(reg_int.read_int(" << rs2 << "));"; break;
+        case o_fsw: ss << "memory.write(reg_int.read_int(" << rs1 << ") + " << imm << ", reg_fp.read_32(" << rs2 << "));"; break;
+        case o_addi: ss << binop_int(a_int + " + " + imm); break;
+        case o_slli: ss << binop_int(a_int + " << " + imm); break;
+        case o_srli: ss << binop_int("static_cast<unsigned int>(" + a_int + ") >> " + imm); break;
+        case o_srai: ss << binop_int(a_int + " >> " + imm); break;
+        case o_andi: ss << binop_int(a_int + " & " + imm); break;
+        case o_lw: ss << "reg_int.write_32(" << rd << ", memory.read(reg_int.read_int(" << rs1 << ") + " << imm << "));"; break;
+        case o_lre: ss << "reg_int.write_int(" << rd << ", receive_buffer.empty() ? 1 : 0);"; break;
+        case o_lrd: ss << "if(receive_buffer.empty()){ pc = " << id << "u; goto L_lrd_error; } reg_int.write_32(" << rd << ", receive_buffer.pop());"; break;
+        case o_ltf: ss << "reg_int.write_int(" << rd << ", 0);"; break;
+        case o_flw: ss << "reg_fp.write_32(" << rd << ", memory.read(reg_int.read_int(" << rs1 << ") + " << imm << "));"; break;
+        case o_jalr: ss << "pc = reg_int.read_int(" << rs1 << "); reg_int.write_int(" << rd << ", " << id + 1 << "); goto L_dispatch;"; break;
+        case o_jal:
+            ss << "reg_int.write_int(" << rd << ", " << id + 1 << "); ";
+            if(op.is_exit()){
+                ss << "pc = " << id << "u; goto L_end;";
+            }else{
+                ss << jump(id + op.imm);
+            }
+            break;
+        case o_lui: ss << "reg_int.write_int(" << rd << ", " << (op.imm << 12) << ");"; break;
+        case o_fmvif: ss << "reg_fp.write_32(" << rd << ", reg_int.read_32(" << rs1 << "));"; break;
+        case o_fmvfi: ss << "reg_int.write_32(" << rd << ", " << a_32 << ");"; break;
+        default: ss << "pc = " << id << "u; goto L_error;"; break; // 不正な命令 (o_siは事前に除外している)
+    }
+    return ss.str();
+}
+
+// op_listをC++に変換してコンパイル (siを含むため変換できない場合はfalse)
+inline bool translate_aot(){
+    for(unsigned int id=0; id<code_size; ++id){
+        if(op_list[id].type == o_si){
+            std::cout << head_warning << "self-modifying code (si at pc " << id << ") detected; falling back to the interpreter" << std::endl;
+            return false;
+        }
+    }
+
+    std::string output_name = "./aot/" + filename;
+    std::string source_name = output_name + ".cpp";
+    std::ofstream source(source_name);
+    if(!source){
+        std::cerr << head_error << "could not open " << source_name << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    std::stringstream ss;
+    ss << "// generated from ./code/" << filename << " by sim --aot" << std::endl;
+    ss << "#include <common.hpp>" << std::endl;
+    ss << "#include <unit.hpp>" << std::endl;
+    ss << "#include <fpu.hpp>" << std::endl;
+    ss << "#include <iostream>" << std::endl;
+    ss << "#include <fstream>" << std::endl;
+    ss << "#include <string>" << std::endl;
+    ss << "#include <vector>" << std::endl;
+    ss << "#include <iterator>" << std::endl;
+    ss << "#include <chrono>" << std::endl;
+    ss << "#include <cmath>" << std::endl;
+    ss << std::endl;
+    ss << "Reg reg_int;" << std::endl;
+    ss << "Reg reg_fp;" << std::endl;
+    ss << "Memory memory;" << std::endl;
+    ss << "Fpu fpu;" << std::endl;
+    ss << "TransmissionQueue receive_buffer;" << std::endl;
+    ss << "TransmissionQueue send_buffer;" << std::endl;
+    ss << std::endl;
+    ss << "int main(int argc, char* argv[]){" << std::endl;
+    ss << "    std::string preload_filename = \"" << (is_preloading ? preload_filename : "") << "\";" << std::endl;
+    ss << "    std::string output_filename = \"\";" << std::endl;
+    ss << "    bool is_verbose = false;" << std::endl;
+    ss << "    for(int i=1; i<argc; ++i){" << std::endl;
+    ss << "        std::string arg = argv[i];" << std::endl;
+    ss << "        if(arg == \"--preload\" && i + 1 < argc) preload_filename = argv[++i];" << std::endl;
+    ss << "        else if(arg == \"-o\" && i + 1 < argc) output_filename = argv[++i];" << std::endl;
+    ss << "        else if(arg == \"-v\") is_verbose = true;" << std::endl;
+    ss << "        else{ std::cerr << \"usage: \" << argv[0] << \" [--preload file] [-o output] [-v]\" << std::endl; return EXIT_FAILURE; }" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "    memory = Memory(" << mem_size << ");" << std::endl;
+    ss << "    if(preload_filename != \"\"){" << std::endl;
+    ss << "        std::ifstream preload_file(preload_filename, std::ios::in | std::ios::binary);" << std::endl;
+    ss << "        if(!preload_file){ std::cerr << \"could not open \" << preload_filename << std::endl; return EXIT_FAILURE; }" << std::endl;
+    // preload_dataと同様に、ファイルの全バイトをまとめて積む (eof()で判定すると最後のバイトが重複する)
+    ss << "        std::vector<char> bytes((std::istreambuf_iterator<char>(preload_file)), std::istreambuf_iterator<char>());" << std::endl;
+    ss << "        receive_buffer.push(reinterpret_cast<const unsigned char*>(bytes.data()), bytes.size());" << std::endl;
+    ss << "    }" << std::endl;
+    ss << std::endl;
+    ss << "    unsigned int pc = " << pc << "u;" << std::endl;
+    ss << "    unsigned long long op_count = 0;" << std::endl;
+    ss << "    auto start = std::chrono::system_clock::now();" << std::endl;
+    ss << "    goto L_dispatch;" << std::endl;
+    ss << std::endl;
+
+    // 本体 (PCごとにラベル)
+    for(unsigned int id=0; id<code_size; ++id){
+        ss << "    L_" << id << ": ++op_count; " << aot_code_of_op(op_list[id], id) << std::endl;
+    }
+    ss << "    pc = " << code_size << "u; goto L_end;" << std::endl;
+    ss << std::endl;
+
+    // jalrの飛び先を求めるswitch
+    ss << "    L_dispatch:" << std::endl;
+    ss << "    switch(pc){" << std::endl;
+    for(unsigned int id=0; id<code_size; ++id){
+        ss << "        case " << id << ": goto L_" << id << ";" << std::endl;
+    }
+    ss << "        default: goto L_end;" << std::endl;
+    ss << "    }" << std::endl;
+    ss << std::endl;
+
+    // 異常終了
+    ss << "    L_lrd_error:" << std::endl;
+    ss << "    std::cerr << \"Error: receive buffer is empty [lrd] (at pc \" << pc << \")\" << std::endl;" << std::endl;
+    ss << "    return EXIT_FAILURE;" << std::endl;
+    ss << "    L_error:" << std::endl;
+    ss << "    std::cerr << \"Error: error in executing the code (at pc \" << pc << \")\" << std::endl;" << std::endl;
+    ss << "    return EXIT_FAILURE;" << std::endl;
+    ss << std::endl;
+
+    // 終了処理
+    ss << "    L_end:" << std::endl;
+    ss << "    {" << std::endl;
+    ss << "        double exec_time = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();" << std::endl;
+    ss << "        std::cerr << \"pc: \" << pc << std::endl;" << std::endl;
+    ss << "        std::cerr << \"operation count: \" << op_count << std::endl;" << std::endl;
+    ss << "        std::cerr << \"time elapsed (execution): \" << exec_time << std::endl;" << std::endl;
+    ss << "        if(is_verbose){" << std::endl;
+    ss << "            reg_int.print(true, t_dec);" << std::endl;
+    ss << "            reg_fp.print(false, t_float);" << std::endl;
+    ss << "        }" << std::endl;
+    ss << "        if(output_filename != \"\"){ // 送信バッファの内容をバイト列として出力" << std::endl;
+    ss << "            std::ofstream output_file(output_filename);" << std::endl;
+    ss << "            if(!output_file){ std::cerr << \"could not open \" << output_filename << std::endl; return EXIT_FAILURE; }" << std::endl;
+    ss << "            std::stringstream output;" << std::endl;
+    ss << "            while(!send_buffer.empty()) output << (unsigned char) send_buffer.pop().i;" << std::endl;
+    ss << "            output_file << output.str();" << std::endl;
+    ss << "        }" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "    return 0;" << std::endl;
+    ss << "}" << std::endl;
+    source << ss.str();
+    source.close();
+    std::cout << head << "translated into " << source_name << std::endl;
+
+    // コンパイル
+    std::string cmd = "g++ -I./ -std=c++20 -O2 -march=native -w -o " + output_name + " " + source_name;
+    std::cout << head << "compiling: " << cmd << std::endl;
+    if(std::system(cmd.c_str()) != 0){
+        std::cerr << head_error << "compilation failed" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    std::cout << head << "native binary: " << output_name << (is_raytracing ? " (run with -o ./out/output.ppm to get the image)" : "") << std::endl;
+    return true;
+}
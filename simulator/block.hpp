@@ -0,0 +1,313 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <fpu.hpp>
+#include <sim.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <cmath>
+#include <exception>
+
+/*
+    基本ブロック単位の実行エンジン
+    - 初めて実行されるPCから分岐命令(beq/blt/fbeq/fblt/jal/jalr)までを1つの基本ブロックとして切り出し、
+      デコード済みの命令列に変換してキャッシュする
+    - 各ブロックは分岐先・フォールスルー先のブロックへのポインタを持ち、2回目以降は表を引かずに直接連結する
+    - 終了判定と命令数のカウント(ブロックごとの静的な命令構成を加算)はブロックの出口でのみ行う
+    - siは命令列を書き換えるのでブロックの終端として扱い、実行後にキャッシュを破棄する
+*/
+
+/* ブロック内のデコード済み命令 */
+struct Block_op{
+    unsigned char type; // Otype
+    unsigned char rd;
+    unsigned char rs1;
+    unsigned char rs2;
+    int imm;
+};
+
+/* 基本ブロック */
+struct Block{
+    unsigned int start; // 先頭のPC
+    std::vector<Block_op> body; // 終端以外の命令
+    Block_op term; // 終端の命令
+    bool has_term; // 終端の命令があるか (コードの末尾で切れた場合はfalse)
+    std::vector<std::pair<Otype, unsigned int>> mix; // 命令の種類ごとの個数 (終端を含む)
+    Block* succ[2]; // 連結先 ([0]: 分岐成立時/jal, [1]: 不成立時/フォールスルー)
+};
+
+std::deque<Block> block_pool; // ブロックの実体
+std::vector<Block*> block_table; // 先頭PCからブロックへの対応
+
+// pcから始まるブロックを作成してキャッシュに登録
+inline Block* compile_block(unsigned int start){
+    Block& b = block_pool.emplace_back();
+    b.start = start;
+    b.has_term = false;
+    b.succ[0] = b.succ[1] = nullptr;
+    unsigned int count[op_type_num + 1] = {};
+    unsigned int id = start;
+    for(; id < code_size; ++id){
+        const Operation& op = op_list[id];
+        Block_op bop{
+            static_cast<unsigned char>(op.type),
+            static_cast<unsigned char>(op.rd),
+            static_cast<unsigned char>(op.rs1),
+            static_cast<unsigned char>(op.rs2),
+            op.imm
+        };
+        ++count[op.type];
+        if(op.is_conditional() || op.is_unconditional() || op.type == o_si){
+            b.term = bop;
+            b.has_term = true;
+            break;
+        }
+        b.body.emplace_back(bop);
+    }
+    for(unsigned int i=0; i<op_type_num; ++i){
+        if(count[i] > 0) b.mix.emplace_back(static_cast<Otype>(i), count[i]);
+    }
+    block_table[start] = &b;
+    return &b;
+}
+
+// キャッシュの破棄
+inline void flush_blocks(){
+    block_pool.clear();
+    block_table.assign(code_size, nullptr);
+}
+
+// 終了状態になるまで基本ブロック単位で実行
+int exec_block(){
+    // op_listはdebugモードのdo/continueでsiにより書き換えられている可能性があるので、毎回キャッシュを作り直す
+    flush_blocks();
+    if(pc >= code_size) return sim_state_end;
+
+    Block* b = block_table[pc] != nullptr ? block_table[pc] : compile_block(pc);
+    while(true){
+        // 終端以外の命令
+        const Block_op* const begin = b->body.data();
+        const Block_op* const end = begin + b->body.size();
+        const Block_op* op = begin;
+        try{
+            for(; op != end; ++op){
+                switch(op->type){
+                    case o_add:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) + reg_int.read_int(op->rs2));
+                        break;
+                    case o_sub:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) - reg_int.read_int(op->rs2));
+                        break;
+                    case o_sll:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) << reg_int.read_int(op->rs2));
+                        break;
+                    case o_srl:
+                        reg_int.write_int(op->rd, static_cast<unsigned int>(reg_int.read_int(op->rs1)) >> reg_int.read_int(op->rs2));
+                        break;
+                    case o_sra:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) >> reg_int.read_int(op->rs2)); // note: 処理系依存
+                        break;
+                    case o_and:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) & reg_int.read_int(op->rs2));
+                        break;
+                    case o_fabs:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, std::abs(reg_fp.read_float(op->rs1)));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.fabs(reg_fp.read_32(op->rs1)));
+                        }
+                        break;
+                    case o_fneg:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, - reg_fp.read_float(op->rs1));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.fneg(reg_fp.read_32(op->rs1)));
+                        }
+                        break;
+                    case o_fdiv:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) / reg_fp.read_float(op->rs2));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.fdiv(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+                        }
+                        break;
+                    case o_fsqrt:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, std::sqrt(reg_fp.read_float(op->rs1)));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.fsqrt(reg_fp.read_32(op->rs1)));
+                        }
+                        break;
+                    case o_fcvtif:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, static_cast<float>(reg_fp.read_int(op->rs1)));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.itof(reg_fp.read_32(op->rs1)));
+                        }
+                        break;
+                    case o_fcvtfi:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, static_cast<int>(std::nearbyint(reg_fp.read_float(op->rs1))));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.ftoi(reg_fp.read_32(op->rs1)));
+                        }
+                        break;
+                    case o_fmvff:
+                        reg_fp.write_32(op->rd, reg_fp.read_32(op->rs1));
+                        break;
+                    case o_fadd:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) + reg_fp.read_float(op->rs2));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.fadd(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+                        }
+                        break;
+                    case o_fsub:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) - reg_fp.read_float(op->rs2));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.fsub(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+                        }
+                        break;
+                    case o_fmul:
+                        if(is_ieee){
+                            reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) * reg_fp.read_float(op->rs2));
+                        }else{
+                            reg_fp.write_32(op->rd, fpu.fmul(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+                        }
+                        break;
+                    case o_sw:
+                        write_memory(reg_int.read_int(op->rs1) + op->imm, reg_int.read_32(op->rs2));
+                        break;
+                    case o_std:
+                        output_std(reg_int.read_int(op->rs2));
+                        break;
+                    case o_fsw:
+                        write_memory(reg_int.read_int(op->rs1) + op->imm, reg_fp.read_32(op->rs2));
+                        break;
+                    case o_addi:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) + op->imm);
+                        break;
+                    case o_slli:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) << op->imm);
+                        break;
+                    case o_srli:
+                        reg_int.write_int(op->rd, static_cast<unsigned int>(reg_int.read_int(op->rs1)) >> op->imm);
+                        break;
+                    case o_srai:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) >> op->imm); // todo: 処理系依存
+                        break;
+                    case o_andi:
+                        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) & op->imm);
+                        break;
+                    case o_lw:
+                        reg_int.write_32(op->rd, read_memory(reg_int.read_int(op->rs1) + op->imm));
+                        break;
+                    case o_lre:
+                        reg_int.write_int(op->rd, receive_buffer.empty() ? 1 : 0);
+                        break;
+                    case o_lrd:
+                        if(!receive_buffer.empty()){
+                            reg_int.write_32(op->rd, receive_buffer.pop());
+                        }else{
+                            throw std::runtime_error("receive buffer is empty [lrd] (at pc " + std::to_string(b->start + (op - begin)) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(b->start + (op - begin)))) : "") + ")");
+                        }
+                        break;
+                    case o_ltf:
+                        reg_int.write_int(op->rd, 0); // 暫定的に、常にfull flagが立っていない(=送信バッファの大きさに制限がない)としている
+                        break;
+                    case o_flw:
+                        reg_fp.write_32(op->rd, read_memory(reg_int.read_int(op->rs1) + op->imm));
+                        break;
+                    case o_lui:
+                        reg_int.write_int(op->rd, op->imm << 12);
+                        break;
+                    case o_fmvif:
+                        reg_fp.write_32(op->rd, reg_int.read_32(op->rs1));
+                        break;
+                    case o_fmvfi:
+                        reg_int.write_32(op->rd, reg_fp.read_32(op->rs1));
+                        break;
+                    default:
+                        throw std::runtime_error("error in executing the code (at pc " + std::to_string(b->start + (op - begin)) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(b->start + (op - begin)))) : "") + ")");
+                }
+            }
+        }catch(...){
+            // 例外の直前までの実行を反映
+            for(const Block_op* p = begin; p != op; ++p) ++op_type_count[p->type];
+            pc = b->start + (op - begin);
+            throw;
+        }
+
+        // 命令数の更新
+        for(const auto& [t, n] : b->mix) op_type_count[t] += n;
+
+        // 終端の命令
+        unsigned int term_pc = b->start + b->body.size();
+        unsigned int next_pc;
+        int next_slot = -1; // 連結に使うsuccの番号 (-1なら連結しない)
+        if(!b->has_term){ // コードの末尾
+            pc = term_pc;
+            return sim_state_end;
+        }
+        const Block_op& t = b->term;
+        switch(t.type){
+            case o_beq:
+            case o_blt:
+            case o_fbeq:
+            case o_fblt:
+                {
+                    bool taken;
+                    switch(t.type){
+                        case o_beq: taken = reg_int.read_int(t.rs1) == reg_int.read_int(t.rs2); break;
+                        case o_blt: taken = reg_int.read_int(t.rs1) < reg_int.read_int(t.rs2); break;
+                        case o_fbeq: taken = reg_fp.read_float(t.rs1) == reg_fp.read_float(t.rs2); break;
+                        default: taken = reg_fp.read_float(t.rs1) < reg_fp.read_float(t.rs2); break;
+                    }
+                    next_pc = taken ? term_pc + t.imm : term_pc + 1;
+                    next_slot = taken ? 0 : 1;
+                    #ifdef EXTENDED
+                    if(is_gshare_enabled) branch_predictor.update(next_pc, taken);
+                    #endif
+                }
+                break;
+            case o_jal:
+                reg_int.write_int(t.rd, term_pc + 1);
+                if(t.rd == 0 && t.imm == 0){ // jal x0, 0
+                    pc = term_pc;
+                    return sim_state_end;
+                }
+                next_pc = term_pc + t.imm;
+                next_slot = 0;
+                break;
+            case o_jalr:
+                next_pc = reg_int.read_int(t.rs1);
+                reg_int.write_int(t.rd, term_pc + 1);
+                break;
+            default: // o_si
+                {
+                    unsigned int id = reg_int.read_int(t.rs1) + t.imm;
+                    op_list[id] = Operation(reg_int.read_int(t.rs2));
+                    next_pc = term_pc + 1;
+                    if(id < code_size) flush_blocks(); // 書き換えられた命令を含むブロックを作り直す
+                }
+                break;
+        }
+
+        // 次のブロックへ
+        if(next_pc >= code_size){
+            pc = next_pc;
+            return sim_state_end;
+        }
+        if(next_slot >= 0 && b->succ[next_slot] != nullptr){
+            b = b->succ[next_slot];
+        }else{
+            Block* next = block_table[next_pc] != nullptr ? block_table[next_pc] : compile_block(next_pc);
+            if(next_slot >= 0) b->succ[next_slot] = next;
+            b = next;
+        }
+    }
+}
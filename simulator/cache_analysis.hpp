@@ -0,0 +1,117 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <string>
+#include <vector>
+#include <array>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+extern std::string head;
+
+/* キャッシュの構成の一括解析 */
+// ブロックの大きさ(2^o ワード)とセット数(2^s)の組ごとに、各セットのLRUスタックを上からanalysis_way_max段だけ保持する
+// アクセスしたブロックがスタックの上からd段目(0始まり)にあれば、連想度がdより大きいLRUのキャッシュではヒットし、それ以外ではミスする
+// したがって、1回の実行でスタック距離の分布を数えておけば、全ての(ブロックの大きさ, セット数, 連想度)の組のヒット率が分かる
+// (読み出し・書き込みとも、ミスしたらそのブロックを載せるものとして扱う)
+class Cache_analyzer{
+    private:
+        static constexpr unsigned int empty_block = static_cast<unsigned int>(-1);
+        struct Stacks{
+            unsigned int offset_width;
+            unsigned int index_width;
+            std::vector<unsigned int> blocks; // セットごとにanalysis_way_max個 (上から順に、最近アクセスしたブロックの番号)
+            std::array<unsigned long long, analysis_way_max> distance_count; // スタック距離ごとのアクセス回数 (それ以上のものはミス)
+        };
+        std::vector<Stacks> stacks;
+        unsigned long long accessed_times = 0;
+        // 連想度がwayのときのヒット数
+        unsigned long long hit_times(const Stacks& s, unsigned int way) const {
+            unsigned long long hit = 0;
+            for(unsigned int d=0; d<way; ++d) hit += s.distance_count[d];
+            return hit;
+        }
+    public:
+        void init(){
+            this->stacks.clear();
+            for(unsigned int o=0; o<=analysis_offset_width_max; ++o){
+                for(unsigned int s=0; s<=analysis_index_width_max; ++s){
+                    this->stacks.push_back({o, s, std::vector<unsigned int>(), {}});
+                }
+            }
+            this->reset();
+        }
+        void reset(){
+            for(auto& s : this->stacks){
+                s.blocks.assign((1u << s.index_width) * analysis_way_max, empty_block);
+                s.distance_count.fill(0);
+            }
+            this->accessed_times = 0;
+        }
+        inline void access(unsigned int addr){
+            ++this->accessed_times;
+            for(auto& s : this->stacks){
+                unsigned int block = addr >> s.offset_width;
+                unsigned int* set = s.blocks.data() + (block & ((1u << s.index_width) - 1)) * analysis_way_max;
+                if(set[0] == block){ // 直前と同じブロック
+                    ++s.distance_count[0];
+                    continue;
+                }
+                unsigned int d = 1;
+                while(d < analysis_way_max && set[d] != block) ++d;
+                if(d < analysis_way_max){
+                    ++s.distance_count[d];
+                }else{
+                    d = analysis_way_max - 1; // 一番下のブロックを追い出す
+                }
+                std::memmove(set + 1, set, d * sizeof(unsigned int));
+                set[0] = block;
+            }
+        }
+        // 全ての構成のヒット率をCSVで書き出し、ブロックの大きさが2^offset_widthのものは容量と連想度の表として画面にも表示する
+        void report(const std::string& output_filename, unsigned int offset_width) const {
+            std::ofstream output_file(output_filename);
+            if(!output_file){
+                std::cerr << head_error << "could not open " << output_filename << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            std::stringstream ss;
+            ss << "offset_width,index_width,ways,block_words,sets,capacity_words,accessed,hit,hit_rate" << std::endl;
+            for(auto& s : this->stacks){
+                for(unsigned int way=1; way<=analysis_way_max; way*=2){
+                    unsigned long long hit = this->hit_times(s, way);
+                    ss << s.offset_width << "," << s.index_width << "," << way << "," << (1u << s.offset_width) << "," << (1u << s.index_width) << ",";
+                    ss << (static_cast<unsigned long long>(way) << (s.offset_width + s.index_width)) << "," << this->accessed_times << "," << hit << ",";
+                    ss << static_cast<double>(hit) / this->accessed_times << std::endl;
+                }
+            }
+            output_file << ss.str();
+
+            if(offset_width <= analysis_offset_width_max){
+                std::stringstream ss_table;
+                ss_table << "hit rate (block size: " << (1u << offset_width) << " words, rows: capacity in words, columns: ways)" << std::endl;
+                ss_table << std::setw(10) << "";
+                for(unsigned int way=1; way<=analysis_way_max; way*=2) ss_table << std::setw(9) << way;
+                ss_table << std::endl;
+                for(unsigned int c=offset_width; c<=offset_width+analysis_index_width_max; ++c){ // 容量は2^cワード
+                    ss_table << std::setw(10) << (1ull << c);
+                    for(unsigned int way=1, w=0; way<=analysis_way_max; way*=2, ++w){
+                        if(c < offset_width + w || c - offset_width - w > analysis_index_width_max){
+                            ss_table << std::setw(9) << "-";
+                        }else{
+                            const Stacks& s = this->stacks[offset_width * (analysis_index_width_max + 1) + (c - offset_width - w)];
+                            ss_table << std::setw(9) << std::fixed << std::setprecision(4) << static_cast<double>(this->hit_times(s, way)) / this->accessed_times;
+                        }
+                    }
+                    ss_table << std::endl;
+                }
+                std::cout << ss_table.str();
+            }
+            std::cout << head << "cache analysis: " << output_filename << std::endl;
+        }
+};
+
+extern Cache_analyzer cache_analyzer;
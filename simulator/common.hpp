@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <atomic>
 #include <string_view>
+#include <array>
 
 /* シミュレータの状態管理 */
 inline constexpr int sim_state_continue = -1;
@@ -21,7 +22,7 @@ inline constexpr std::string_view head_warning = "\033[2D\x1b[33mWarning: \x1b[0
 
 
 /* 命令の種類 */
-enum Otype{
+enum Otype : unsigned char{
     o_add, o_sub, o_sll, o_srl, o_sra, o_and,
     o_fabs, o_fneg, o_fdiv, o_fsqrt, o_fcvtif, o_fcvtfi, o_fmvff,
     o_fadd, o_fsub, o_fmul,
@@ -40,6 +41,29 @@ enum Otype{
     o_nop // コアの実装では'1などに対応(内部的にしか使わない)
 };
 
+/* 命令の属性(Otypeごとにotype_attr_tableに前計算しておく) */
+inline constexpr unsigned int a_op = 1 << 0;
+inline constexpr unsigned int a_op_fp = 1 << 1;
+inline constexpr unsigned int a_branch = 1 << 2;
+inline constexpr unsigned int a_branch_fp = 1 << 3;
+inline constexpr unsigned int a_unconditional = 1 << 4; // jal, jalr
+inline constexpr unsigned int a_store = 1 << 5;
+inline constexpr unsigned int a_op_imm = 1 << 6;
+inline constexpr unsigned int a_load = 1 << 7;
+inline constexpr unsigned int a_lw_flw_sw_fsw = 1 << 8;
+inline constexpr unsigned int a_mem = 1 << 9;
+inline constexpr unsigned int a_alu = 1 << 10;
+inline constexpr unsigned int a_multicycle_fpu = 1 << 11;
+inline constexpr unsigned int a_pipelined_fpu = 1 << 12;
+inline constexpr unsigned int a_rd_int = 1 << 13;
+inline constexpr unsigned int a_rd_fp = 1 << 14;
+inline constexpr unsigned int a_rs1_int = 1 << 15;
+inline constexpr unsigned int a_rs1_fp = 1 << 16;
+inline constexpr unsigned int a_rs2_int = 1 << 17;
+inline constexpr unsigned int a_rs2_fp = 1 << 18;
+inline constexpr unsigned int a_zero_latency_mfp = 1 << 19;
+inline constexpr unsigned int a_nonzero_latency_mfp = 1 << 20;
+
 /* 文字列変換の際に指定対象となる型 */
 enum class Stype{
     t_default, t_dec, t_bin, t_hex, t_float, t_op
@@ -66,18 +90,19 @@ union Bit32{
     std::string to_string(Stype t);
 };
 
-/* 命令のクラス */
+/* 命令のクラス(デコード済みの命令を8バイトに詰めて保持する) */
 class Operation{
     public:
         Otype type;
-        unsigned int rs1;
-        unsigned int rs2;
-        unsigned int rd;
+        unsigned char rs1;
+        unsigned char rs2;
+        unsigned char rd;
         int imm;
         constexpr Operation();
         Operation(std::string code);
-        Operation(int i);
+        constexpr Operation(int i);
         std::string to_string();
+        constexpr bool has_attr(unsigned int) const;
         constexpr bool is_op() const;
         constexpr bool is_op_fp() const;
         constexpr bool is_branch() const;
@@ -111,6 +136,7 @@ class Operation{
         constexpr bool is_nop() const;
         constexpr bool is_exit() const;
 };
+static_assert(sizeof(Operation) == 8);
 
 /* プロトタイプ宣言 */
 int int_of_binary(std::string);
@@ -124,6 +150,8 @@ constexpr unsigned int take_bit(unsigned int, int);
 constexpr unsigned int take_bits(unsigned int, int, int);
 constexpr unsigned long long take_bits(unsigned long long, int, int);
 constexpr unsigned int isset_bit(unsigned int, unsigned int);
+constexpr int sign_extend(unsigned int, int);
+constexpr unsigned int attr_of_otype(Otype);
 
 using enum Otype;
 using enum Stype;
@@ -175,6 +203,101 @@ inline std::string string_of_otype(Otype t){
     }
 }
 
+// Otypeから命令の属性を計算
+inline constexpr unsigned int attr_of_otype(Otype t) noexcept {
+    switch(t){
+        case o_add:
+        case o_sub:
+        case o_sll:
+        case o_srl:
+        case o_sra:
+        case o_and:
+            return a_op | a_alu | a_rd_int | a_rs1_int | a_rs2_int;
+        case o_fabs:
+        case o_fneg:
+        case o_fmvff:
+            return a_op_fp | a_multicycle_fpu | a_zero_latency_mfp | a_rd_fp | a_rs1_fp | a_rs2_fp;
+        case o_fdiv:
+        case o_fsqrt:
+        case o_fcvtif:
+        case o_fcvtfi:
+            return a_op_fp | a_multicycle_fpu | a_nonzero_latency_mfp | a_rd_fp | a_rs1_fp | a_rs2_fp;
+        case o_fadd:
+        case o_fsub:
+        case o_fmul:
+            return a_op_fp | a_pipelined_fpu | a_rd_fp | a_rs1_fp | a_rs2_fp;
+        case o_beq:
+        case o_blt:
+            return a_branch | a_rs1_int | a_rs2_int;
+        case o_fbeq:
+        case o_fblt:
+            return a_branch_fp | a_rs1_fp | a_rs2_fp;
+        case o_sw:
+            return a_store | a_mem | a_lw_flw_sw_fsw | a_rs1_int | a_rs2_int;
+        case o_si:
+        case o_std:
+            return a_store | a_mem | a_rs1_int | a_rs2_int;
+        case o_fsw:
+            return a_mem | a_lw_flw_sw_fsw | a_rs1_int | a_rs2_fp;
+        case o_addi:
+        case o_slli:
+        case o_srli:
+        case o_srai:
+        case o_andi:
+            return a_op_imm | a_alu | a_rd_int | a_rs1_int;
+        case o_lw:
+            return a_load | a_mem | a_lw_flw_sw_fsw | a_rd_int | a_rs1_int;
+        case o_lre:
+        case o_lrd:
+        case o_ltf:
+            return a_load | a_mem | a_rd_int | a_rs1_int;
+        case o_flw:
+            return a_mem | a_lw_flw_sw_fsw | a_rd_fp | a_rs1_int;
+        case o_jalr:
+            return a_unconditional | a_alu | a_rd_int | a_rs1_int;
+        case o_jal:
+            return a_unconditional | a_alu | a_rd_int;
+        case o_lui:
+            return a_alu | a_rd_int;
+        case o_fmvif:
+            return a_alu | a_multicycle_fpu | a_zero_latency_mfp | a_rd_fp | a_rs1_int;
+        case o_fmvfi:
+            return a_rd_int | a_rs1_fp;
+        default: // o_nop
+            return 0;
+    }
+}
+
+// 属性のテーブル(判定は表引きとビット演算のみで済む)
+inline constexpr auto otype_attr_table = [](){
+    std::array<unsigned int, o_nop + 1> table{};
+    for(unsigned int t=0; t<=o_nop; ++t) table[t] = attr_of_otype(static_cast<Otype>(t));
+    return table;
+}();
+
+// opcode(4ビット)とfunct(3ビット)を並べた7ビットからOtypeを引くテーブル(該当する命令がなければo_nop)
+inline constexpr auto otype_table = [](){
+    std::array<Otype, 128> table{};
+    table.fill(o_nop);
+    auto set = [&](unsigned int opcode, unsigned int funct, Otype t){ table[(opcode << 3) | funct] = t; };
+    set(0, 0, o_add); set(0, 1, o_sub); set(0, 2, o_sll); set(0, 3, o_srl); set(0, 4, o_sra); set(0, 5, o_and); // op
+    set(1, 0, o_fabs); set(1, 1, o_fneg); set(1, 3, o_fdiv); set(1, 4, o_fsqrt); set(1, 5, o_fcvtif); set(1, 6, o_fcvtfi); set(1, 7, o_fmvff); // op_mfp
+    set(2, 0, o_fadd); set(2, 1, o_fsub); set(2, 2, o_fmul); // op_pfp
+    set(3, 0, o_beq); set(3, 1, o_blt); // branch
+    set(4, 2, o_fbeq); set(4, 3, o_fblt); // branch_fp
+    set(5, 0, o_sw); set(5, 1, o_si); set(5, 2, o_std); // store
+    set(6, 0, o_fsw); // store_fp
+    set(7, 0, o_addi); set(7, 2, o_slli); set(7, 3, o_srli); set(7, 4, o_srai); set(7, 5, o_andi); // op_imm
+    set(8, 0, o_lw); set(8, 1, o_lre); set(8, 2, o_lrd); set(8, 3, o_ltf); // load
+    set(9, 0, o_flw); // load_fp
+    set(10, 0, o_jalr); // jalr
+    set(11, 0, o_jal); // jal
+    set(12, 0, o_lui); // lui
+    set(13, 0, o_fmvif); // itof
+    set(14, 0, o_fmvfi); // ftoi
+    return table;
+}();
+
 
 /* class Bit32 */
 inline constexpr Bit32::Bit32() noexcept {
@@ -226,10 +349,7 @@ inline std::string Bit32::to_string(Stype t){
             res = std::to_string(this->f);;
             break;
         case t_op:
-            {
-                std::bitset<32> bs(this->i);
-                res = Operation(bs.to_string()).to_string();
-            }
+            res = Operation(this->i).to_string();
             break;
         default: std::exit(EXIT_FAILURE);
     }
@@ -244,276 +364,106 @@ inline constexpr Operation::Operation() noexcept {
     this->type = o_nop;
     this->rs1 = 0;
     this->rs2 = 0;
+    this->rd = 0;
     this->imm = 0;
 }
 
-// intをもとにするコンストラクタ
-inline Operation::Operation(int i) noexcept {
-    std::stringstream code;
-    code << std::bitset<32>(i);
-    (*this) = Operation(code.str());
-}
-
-// stringをパースするコンストラクタ
-inline Operation::Operation(std::string code){
-    unsigned int opcode = std::stoi(code.substr(0, 4), 0, 2);
-    unsigned int funct = std::stoi(code.substr(4, 3), 0, 2);
-    this->rs1 = std::stoi(code.substr(7, 5), 0, 2);
-    this->rs2 = std::stoi(code.substr(12, 5), 0, 2);
-    this->rd = std::stoi(code.substr(17, 5), 0, 2);
+// 32ビットの命令列をシフトとマスクでデコードするコンストラクタ(定数式でも使える)
+inline constexpr Operation::Operation(int i) noexcept {
+    unsigned int code = static_cast<unsigned int>(i);
+    this->type = otype_table[take_bits(code, 25, 31)];
+    this->rs1 = take_bits(code, 20, 24);
+    this->rs2 = take_bits(code, 15, 19);
+    this->rd = take_bits(code, 10, 14);
     this->imm = 0;
 
-    switch(opcode){
-        case 0: // op
-            switch(funct){
-                case 0: // add
-                    this->type = o_add;
-                    return;
-                case 1: // sub
-                    this->type = o_sub;
-                    return;
-                case 2: // sll
-                    this->type = o_sll;
-                    return;
-                case 3: // srl
-                    this->type = o_srl;
-                    return;
-                case 4: // sra
-                    this->type = o_sra;
-                    return;
-                case 5: // and
-                    this->type = o_and;
-                    return;
-                default: break;
-            }
-            break;
-        case 1: // op_mfp
-            switch(funct){
-                case 0: // fabs
-                    this->type = o_fabs;
-                    return;
-                case 1: // fneg
-                    this->type = o_fneg;
-                    return;
-                case 3: // fdiv
-                    this->type = o_fdiv;
-                    return;
-                case 4: // fsqrt
-                    this->type = o_fsqrt;
-                    return;
-                case 5: // fcvt.i.f
-                    this->type = o_fcvtif;
-                    return;
-                case 6: // fcvt.f.i
-                    this->type = o_fcvtfi;
-                    return;
-                case 7: // fmv.f.f
-                    this->type = o_fmvff;
-                    return;
-                default: break;
-            }
-            break;
-        case 2: // op_pfp
-            switch(funct){
-                case 0: // fadd
-                    this->type = o_fadd;
-                    return;
-                case 1: // fsub
-                    this->type = o_fsub;
-                    return;
-                case 2: // fmul
-                    this->type = o_fmul;
-                    return;
-                default: break;
-            }
-            break;
-        case 3: // branch
-            this->imm = int_of_binary(code.substr(17, 15));
-            switch(funct){
-                case 0: // beq
-                    this->type = o_beq;
-                    return;
-                case 1: // blt
-                    this->type = o_blt;
-                    return;
-                default: break;
-            }
-            break;
-        case 4: // branch_fp
-            this->imm = int_of_binary(code.substr(17, 15));
-            switch(funct){
-                case 2: // fbeq
-                    this->type = o_fbeq;
-                    return;
-                case 3: // fblt
-                    this->type = o_fblt;
-                    return;
-                default: break;
-            }
-            break;
-        case 5: // store
-            switch(funct){
-                case 0: // sw
-                    this->type = o_sw;
-                    this->rs1 = rs1;
-                    this->imm = int_of_binary(code.substr(17, 15));
-                    return;
-                case 1: // si
-                    this->type = o_si;
-                    this->rs1 = rs1;
-                    this->imm = int_of_binary(code.substr(17, 15));
-                    return;
-                case 2: // std
-                    this->type = o_std;
-                    return;
-                default: break;
-            }
-            break;
-        case 6: // store_fp
-            this->imm = int_of_binary(code.substr(17, 15));
-            switch(funct){
-                case 0: // fsw
-                    this->type = o_fsw;
-                    return;
-                default: break;
-            }
-            break;
-        case 7: // op_imm
-            this->imm = int_of_binary(code.substr(12, 5) + code.substr(22, 10));
-            switch(funct){
-                case 0: // addi
-                    this->type = o_addi;
-                    return;
-                case 2: // slli
-                    this->type = o_slli;
-                    return;
-                case 3: // srli
-                    this->type = o_srli;
-                    return;
-                case 4: // srai
-                    this->type = o_srai;
-                    return;
-                case 5: // andi
-                    this->type = o_andi;
-                    return;
-                default: break;
-            }
-            break;
-        case 8: // load
-            switch(funct){
-                case 0: // lw
-                    this->type = o_lw;
-                    this->rs1 = rs1;
-                    this->imm = int_of_binary(code.substr(12, 5) + code.substr(22, 10));
-                    return;
-                case 1: // lre
-                    this->type = o_lre;
-                    return;
-                case 2: // lrd
-                    this->type = o_lrd;
-                    return;
-                case 3: // ltf
-                    this->type = o_ltf;
-                    return;
-                default: break;
-            }
-            break;
-        case 9: // load_fp
-            this->imm = int_of_binary(code.substr(12, 5) + code.substr(22, 10));
-            switch(funct){
-                case 0: // flw
-                    this->type = o_flw;
-                    return;
-                default: break;
-            }
-            break;
-        case 10: // jalr
-            switch(funct){
-                case 0: // jalr
-                    this->type = o_jalr;
-                    return;
-                default: break;
-            }
-            break;
-        case 11: // jal
-            this->imm = int_of_binary(code.substr(12, 5) + code.substr(22, 10));
-            switch(funct){
-                case 0: // jal
-                    this->type = o_jal;
-                    return;
-                default: break;
-            }
-            break;
-        case 12: // lui
-            this->imm = int_of_binary("0" + code.substr(7, 10) + code.substr(22, 10));
-            switch(funct){
-                case 0: // lui
-                    this->type = o_lui;
-                    return;
-                default: break;
-            }
+    switch(this->type){
+        case o_beq:
+        case o_blt:
+        case o_fbeq:
+        case o_fblt:
+        case o_sw:
+        case o_si:
+        case o_fsw:
+            this->imm = sign_extend(take_bits(code, 0, 14), 15);
             break;
-        case 13: // itof
-            switch(funct){
-                case 0: // itof
-                    this->type = o_fmvif;
-                    return;
-                default: break;
-            }
+        case o_addi:
+        case o_slli:
+        case o_srli:
+        case o_srai:
+        case o_andi:
+        case o_lw:
+        case o_flw:
+        case o_jal:
+            this->imm = sign_extend((take_bits(code, 15, 19) << 10) | take_bits(code, 0, 9), 15);
             break;
-        case 14: // ftoi
-            switch(funct){
-                case 0: // ftoi
-                    this->type = o_fmvfi;
-                    return;
-                default: break;
-            }
+        case o_lui:
+            this->imm = static_cast<int>((take_bits(code, 15, 24) << 10) | take_bits(code, 0, 9));
             break;
-        default:
+        case o_nop: // 対応する命令がない
             std::cerr << head_error << "could not parse the code" << std::endl;
             std::exit(EXIT_FAILURE);
+        default: break;
     }
+}
 
-    std::cerr << head_error << "could not parse the code" << std::endl;
-    std::exit(EXIT_FAILURE);
+// 0と1からなる文字列をパースするコンストラクタ(先頭の32文字を命令列として読む)
+inline Operation::Operation(std::string code){
+    if(code.size() < 32){
+        std::cerr << head_error << "could not parse the code" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    unsigned int acc = 0;
+    for(int k=0; k<32; ++k){
+        if(code[k] != '0' && code[k] != '1'){
+            std::cerr << head_error << "could not parse the code" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        acc = (acc << 1) | (code[k] == '1');
+    }
+    (*this) = Operation(static_cast<int>(acc));
 }
 
 // opの属性に関する判定
+inline constexpr bool Operation::has_attr(unsigned int a) const noexcept {
+    return (otype_attr_table[this->type] & a) != 0;
+}
 inline constexpr bool Operation::is_op() const noexcept {
-    return this->type == o_add || this->type == o_sub || this->type == o_sll || this->type == o_srl || this->type == o_sra || this->type == o_and;
+    return this->has_attr(a_op);
 }
 inline constexpr bool Operation::is_op_fp() const noexcept {
-    return this->type == o_fadd || this->type == o_fsub || this->type == o_fabs || this->type == o_fneg || this->type == o_fmul || this->type == o_fdiv || this->type == o_fsqrt || this->type == o_fcvtif || this->type == o_fcvtfi || this->type == o_fmvff;
+    return this->has_attr(a_op_fp);
 }
 inline constexpr bool Operation::is_branch() const noexcept {
-    return this->type == o_beq || this->type == o_blt;
+    return this->has_attr(a_branch);
 }
 inline constexpr bool Operation::is_branch_fp() const noexcept {
-    return this->type == o_fbeq || this->type == o_fblt;
+    return this->has_attr(a_branch_fp);
 }
 inline constexpr bool Operation::is_conditional() const noexcept {
-    return this->is_branch() || this->is_branch_fp();
+    return this->has_attr(a_branch | a_branch_fp);
 }
 inline constexpr bool Operation::is_unconditional() const noexcept {
-    return this->type == o_jalr || this->type == o_jal;
+    return this->has_attr(a_unconditional);
 }
 inline constexpr bool Operation::is_store() const noexcept {
-    return this->type == o_sw || this->type == o_si || this->type == o_std;
+    return this->has_attr(a_store);
 }
 inline constexpr bool Operation::is_store_fp() const noexcept {
     return this->type == o_fsw;
 }
 inline constexpr bool Operation::is_op_imm() const noexcept {
-    return this->type == o_addi || this->type == o_slli || this->type == o_srli || this->type == o_srai || this->type == o_andi;
+    return this->has_attr(a_op_imm);
 }
 inline constexpr bool Operation::is_load() const noexcept {
-    return this->type == o_lw || this->type == o_lre || this->type == o_lrd || this->type == o_ltf;
+    return this->has_attr(a_load);
 }
 inline constexpr bool Operation::is_load_fp() const noexcept {
     return this->type == o_flw;
 }
 inline constexpr bool Operation::is_lw_flw_sw_fsw() const noexcept {
-    return this->type == o_lw || this->type == o_flw || this->type == o_sw || this->type == o_fsw;
+    return this->has_attr(a_lw_flw_sw_fsw);
 }
 inline constexpr bool Operation::is_jalr() const noexcept {
     return this->type == o_jalr;
@@ -531,43 +481,43 @@ inline constexpr bool Operation::is_ftoi() const noexcept {
     return this->type == o_fmvfi;
 }
 inline constexpr bool Operation::use_mem() const noexcept {
-    return this->is_load() || this->is_load_fp() || this->is_store() || this->is_store_fp();
+    return this->has_attr(a_mem);
 }
 inline constexpr bool Operation::use_alu() const noexcept {
-    return this->is_op() || this->is_op_imm() || this->is_lui() || this->is_jal() || this->is_jalr() || this->is_itof();
+    return this->has_attr(a_alu);
 }
 inline constexpr bool Operation::use_multicycle_fpu() const noexcept {
-    return this->type == o_fabs || this->type == o_fneg || this->type == o_fdiv || this->type == o_fsqrt || this->type == o_fcvtif || this->type == o_fcvtfi || this->type == o_fmvff || this->type == o_fmvif;
+    return this->has_attr(a_multicycle_fpu);
 }
 inline constexpr bool Operation::use_pipelined_fpu() const noexcept {
-    return this->type == o_fadd || this->type == o_fsub || this->type == o_fmul;
+    return this->has_attr(a_pipelined_fpu);
 }
 inline constexpr bool Operation::use_rd_int() const noexcept {
-    return this->is_op() || this->is_op_imm() || this->is_lui() || this->is_load() || this->is_jal() || this->is_jalr() || this->is_ftoi();
+    return this->has_attr(a_rd_int);
 }
 inline constexpr bool Operation::use_rd_fp() const noexcept {
-    return this->is_op_fp() || this->is_load_fp() || this->is_itof();
+    return this->has_attr(a_rd_fp);
 }
 inline constexpr bool Operation::use_rs1_int() const noexcept {
-    return this->is_op() || this->is_op_imm() || this->is_load() || this->is_load_fp() || this->is_store() || this->is_store_fp() || this->is_branch() || this->is_jalr() || this->is_itof();
+    return this->has_attr(a_rs1_int);
 }
 inline constexpr bool Operation::use_rs1_fp() const noexcept {
-    return this->is_op_fp() || this->is_branch_fp() || this->is_ftoi();
+    return this->has_attr(a_rs1_fp);
 }
 inline constexpr bool Operation::use_rs2_int() const noexcept {
-    return this->is_op() || this->is_store() || this->is_branch();
+    return this->has_attr(a_rs2_int);
 }
 inline constexpr bool Operation::use_rs2_fp() const noexcept {
-    return this->is_op_fp() || this->is_store_fp() || this->is_branch_fp();
+    return this->has_attr(a_rs2_fp);
 }
 inline constexpr bool Operation::branch_conditionally_or_unconditionally() const noexcept {
-    return this->is_branch() || this->is_branch_fp() || this->is_jal() || this->is_jalr();
+    return this->has_attr(a_branch | a_branch_fp | a_unconditional);
 }
 inline constexpr bool Operation::is_zero_latency_mfp() const noexcept {
-    return this->type == o_fabs || this->type == o_fneg || this->type == o_fmvif || this->type == o_fmvff;
+    return this->has_attr(a_zero_latency_mfp);
 }
 inline constexpr bool Operation::is_nonzero_latency_mfp() const noexcept {
-    return this->type == o_fdiv || this->type == o_fsqrt || this->type == o_fcvtif || this->type == o_fcvtfi;
+    return this->has_attr(a_nonzero_latency_mfp);
 }
 inline constexpr bool Operation::is_nop() const noexcept {
     return this->type == o_nop;
@@ -759,6 +709,15 @@ constexpr inline unsigned int isset_bit(unsigned int x, unsigned int n) noexcept
     return ((x >> n) & 1) == 1;
 }
 
+// 下位nビットを符号拡張
+constexpr inline int sign_extend(unsigned int x, int n) noexcept {
+    return static_cast<int>(x << (32 - n)) >> (32 - n);
+}
+
+// デコーダが定数式で評価できることの確認
+static_assert(Operation(static_cast<int>(0xb0000000u)).is_exit()); // jal x0, 0
+static_assert(Operation(static_cast<int>(0x3007fffeu)).imm == -2); // beq x0, x0, -2
+
 
 /* スレッドの管理用フラグ */
 class Cancel_flag{
@@ -766,4 +725,5 @@ class Cancel_flag{
     public:
         void signal(){signaled_ = true;}
         bool operator!() {return !signaled_;}
+        bool is_signaled() {return signaled_;}
 };
@@ -4,6 +4,7 @@
 #include <unit.hpp>
 #include <fpu.hpp>
 #include <sim2.hpp>
+#include <profiler.hpp>
 #include <string>
 #include <array>
 #include <optional>
@@ -109,12 +110,12 @@ class Configuration{
                         unsigned int pht_index;
                         unsigned int pht_data;
                         std::optional<int> branch_addr;
-                        void exec();
+                        void exec(unsigned long long clk);
                 };
                 class EX_ma{
                     public:
                         std::array<Instruction, 3> inst;
-                        void exec();
+                        void exec(unsigned long long clk);
                 };
                 class EX_mfp{
                     public:
@@ -172,6 +173,15 @@ using enum Configuration::EX_stage::EX_mfp::State_mfp;
 
 // クロックを1つ分先に進める
 inline int Configuration::advance_clock(bool verbose, const std::string& bp){
+    // MA3のlrdがまだ届いていないバイトを読もうとしている場合は、届くまでパイプライン全体を止める (ce = false)
+    // 止まっている間は状態が変わらないので、届くクロックまで一度に進める
+    if(is_uart && this->EX.ma.inst[2].op.type == o_lrd && !receive_buffer.empty() && !uart.is_arrived(this->clk)){
+        unsigned long long arrival = uart.arrival_clk();
+        uart.receive_stall_cycles += arrival - this->clk;
+        this->clk = arrival;
+        return sim_state_continue;
+    }
+
     Configuration config_next = Configuration(); // *thisを現在の状態として、次の状態
     int res = sim_state_continue;
 
@@ -185,7 +195,7 @@ inline int Configuration::advance_clock(bool verbose, const std::string& bp){
     }
 
     // BR
-    this->EX.br.exec();
+    this->EX.br.exec(this->clk);
 
     // MA
     /*
@@ -197,7 +207,7 @@ inline int Configuration::advance_clock(bool verbose, const std::string& bp){
     */
     // シミュレータの内部的な命令実行 (MA3)
     if(!this->EX.ma.inst[2].op.is_nop()){
-        this->EX.ma.exec();
+        this->EX.ma.exec(this->clk);
         if(this->EX.ma.inst[2].op.type == o_lre || this->EX.ma.inst[2].op.type == o_ltf || this->EX.ma.inst[2].op.type == o_lrd || this->EX.ma.inst[2].op.type == o_lw){
             config_next.wb_req_int(this->EX.ma.inst[2]);
         }else if(this->EX.ma.inst[2].op.type == o_si){
@@ -890,7 +900,7 @@ inline void Configuration::EX_stage::EX_al::exec(){
     }
 }
 
-inline void Configuration::EX_stage::EX_br::exec(){
+inline void Configuration::EX_stage::EX_br::exec(unsigned long long clk){
     bool comp_res;
     int target = this->inst.pc + this->inst.op.imm;
     switch(this->inst.op.type){
@@ -927,6 +937,7 @@ inline void Configuration::EX_stage::EX_br::exec(){
     }
 
     this->actual_branch_taken = comp_res;
+    if(is_call_graph && this->inst.op.is_unconditional()) call_graph.update(this->inst.op.type, this->inst.op.rd, this->inst.pc, target, clk); // 関数の呼び出し・復帰
 
     // 外れた場合のみ分岐を有効化
     if(
@@ -937,7 +948,7 @@ inline void Configuration::EX_stage::EX_br::exec(){
     }
 }
 
-inline void Configuration::EX_stage::EX_ma::exec(){
+inline void Configuration::EX_stage::EX_ma::exec(unsigned long long clk){
     switch(this->inst[2].op.type){
         case o_sw:
             memory.write(this->inst[2].ma_addr(), this->inst[2].rs2_v);
@@ -948,7 +959,8 @@ inline void Configuration::EX_stage::EX_ma::exec(){
             ++op_type_count[o_si];
             return;
         case o_std:
-            send_buffer.push(this->inst[2].rs2_v);
+            output_std(this->inst[2].rs2_v);
+            if(is_uart) uart.send(clk);
             ++op_type_count[o_std];
             return;
         case o_fsw:
@@ -960,19 +972,32 @@ inline void Configuration::EX_stage::EX_ma::exec(){
             ++op_type_count[o_lw];
             return;
         case o_lre:
-            reg_int.write_int(this->inst[2].op.rd, receive_buffer.empty() ? 1 : 0);
+            if(receive_buffer.empty()){
+                reg_int.write_int(this->inst[2].op.rd, 1);
+            }else if(is_uart && !uart.is_arrived(clk)){ // 次のバイトがまだ届いていない
+                reg_int.write_int(this->inst[2].op.rd, 1);
+                ++uart.receive_wait_count;
+            }else{
+                reg_int.write_int(this->inst[2].op.rd, 0);
+            }
             ++op_type_count[o_lre];
             return;
         case o_lrd:
-            if(!receive_buffer.empty()){
+            if(!receive_buffer.empty()){ // --uartのもとでは、バイトが届くまでadvance_clockで止めてある
                 reg_int.write_32(this->inst[2].op.rd, receive_buffer.pop());
+                if(is_uart) uart.receive();
             }else{
                 throw std::runtime_error("receive buffer is empty [lrd] (at pc " + std::to_string(this->inst[2].pc) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(this->inst[2].pc))) : "") + ")");
             }
             ++op_type_count[o_lrd];
             return;
         case o_ltf:
-            reg_int.write_int(this->inst[2].op.rd, 0); // 暫定的に、常にfull flagが立っていない(=送信バッファの大きさに制限がない)としている
+            if(is_uart && uart.is_send_full(clk)){
+                reg_int.write_int(this->inst[2].op.rd, 1);
+                ++uart.send_full_count;
+            }else{
+                reg_int.write_int(this->inst[2].op.rd, 0); // --uartでなければ、常にfull flagが立っていない(=送信バッファの大きさに制限がない)としている
+            }
             ++op_type_count[o_ltf];
             return;
         case o_flw:
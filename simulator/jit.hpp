@@ -0,0 +1,550 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <fpu.hpp>
+#include <sim.hpp>
+#include <string>
+#include <vector>
+#include <deque>
+#include <exception>
+#include <sys/mman.h>
+
+/*
+    x86-64向けのJITコンパイラ
+    - 一定回数(jit_threshold)以上実行された基本ブロック(分岐命令またはsiで終わる命令列)をネイティブコードに変換する
+    - それまではexec_opで1命令ずつ実行する
+    - ホスト側のレジスタ割り当て
+        rbx: reg_intの先頭, rbp: reg_fpの先頭, r12: memoryの先頭, r13: Jit_context
+    - 整数演算・メモリアクセスはインラインで、FPUの演算(--ieeeでない場合)や送受信はヘルパー関数の呼び出しで処理する
+    - --ieeeの場合の浮動小数演算はSSE命令に変換する
+    - 行き先が静的に決まるブロックの出口(条件分岐・jal)は、行き先のブロックがコンパイルされ次第そのブロックへの直接のジャンプに書き換える
+    - 命令数のカウント(と、sim+では分岐予測器の更新)も生成コードの中で行う
+    - 生成コードは例外を投げず、状態コードを返してexec_jit側で例外を投げる
+*/
+
+/* 生成コードとのやりとりに使う構造体 */
+struct Jit_context{
+    Bit32* reg_int; // +0
+    Bit32* reg_fp; // +8
+    Bit32* mem; // +16
+    unsigned int pc; // +24: 次のPC (エラー時はエラーの起きたPC)
+    unsigned int start; // +28: エラー時、エラーの起きたブロックの先頭のPC
+};
+
+/* 生成コードの返り値 */
+inline constexpr int jit_status_continue = 0;
+inline constexpr int jit_status_exit = 1; // jal x0, 0
+inline constexpr int jit_status_lrd = 2; // 受信バッファが空の状態でlrd
+inline constexpr int jit_status_invalid = 3; // 不正な命令
+
+using Jit_func = int (*)(Jit_context*);
+
+/* コンパイル済みのブロック */
+struct Jit_block{
+    Jit_func code; // 入口 (レジスタの退避などを行ってからbodyへ)
+    unsigned char* body; // 他のブロックから直接ジャンプしてくる先
+    unsigned int start;
+};
+
+inline constexpr size_t jit_code_size = 64 << 20; // コード領域の大きさ
+inline constexpr size_t jit_block_max = 1 << 16; // 1ブロックあたりのコードの上限
+inline constexpr unsigned int jit_block_op_max = 1000; // 1ブロックあたりの命令数の上限
+
+unsigned char* jit_code = nullptr; // コード領域 (mmapで確保)
+size_t jit_code_used = 0;
+std::deque<Jit_block> jit_pool;
+std::vector<Jit_block*> jit_table; // 先頭PCからブロックへの対応
+std::vector<unsigned int> jit_hot_count; // 先頭PCごとの(コンパイル前の)実行回数
+std::vector<std::vector<unsigned char*>> jit_pending; // 先頭PCごとの、そのブロックのコンパイル後に直接のジャンプに書き換える出口
+bool jit_flush_requested = false; // siで命令列が書き換えられた
+
+
+/* 生成コードから呼ばれるヘルパー関数 */
+inline unsigned int jit_fabs(unsigned int a){ return fpu.fabs(Bit32(a)).ui; }
+inline unsigned int jit_fneg(unsigned int a){ return fpu.fneg(Bit32(a)).ui; }
+inline unsigned int jit_fdiv(unsigned int a, unsigned int b){ return fpu.fdiv(Bit32(a), Bit32(b)).ui; }
+inline unsigned int jit_fsqrt(unsigned int a){ return fpu.fsqrt(Bit32(a)).ui; }
+inline unsigned int jit_itof(unsigned int a){ return fpu.itof(Bit32(a)).ui; }
+inline unsigned int jit_ftoi(unsigned int a){ return fpu.ftoi(Bit32(a)).ui; }
+inline unsigned int jit_fadd(unsigned int a, unsigned int b){ return fpu.fadd(Bit32(a), Bit32(b)).ui; }
+inline unsigned int jit_fsub(unsigned int a, unsigned int b){ return fpu.fsub(Bit32(a), Bit32(b)).ui; }
+inline unsigned int jit_fmul(unsigned int a, unsigned int b){ return fpu.fmul(Bit32(a), Bit32(b)).ui; }
+inline int jit_lre(){ return receive_buffer.empty() ? 1 : 0; }
+inline int jit_lrd(Bit32* dst){ // 受信バッファが空なら0を返す
+    if(receive_buffer.empty()) return 0;
+    Bit32 v = receive_buffer.pop();
+    if(dst != nullptr) *dst = v;
+    return 1;
+}
+inline void jit_std(int v){ output_std(v); }
+#ifdef EXTENDED
+inline void jit_branch(unsigned int next_pc, int taken){ branch_predictor.update(next_pc, taken != 0); }
+#endif
+inline void jit_si(int id, int v){
+    op_list[id] = Operation(v);
+    if(static_cast<unsigned int>(id) < code_size) jit_flush_requested = true;
+}
+
+
+/* x86-64の機械語の組み立て */
+class Jit_emitter{
+    private:
+        unsigned char* p;
+    public:
+        // ホストのレジスタ番号
+        static constexpr int rax = 0, rcx = 1, rdx = 2, rbx = 3, rsp = 4, rbp = 5, rsi = 6, rdi = 7;
+        static constexpr int r12 = 12, r13 = 13;
+        Jit_emitter(unsigned char* p) : p(p) {}
+        unsigned char* cur(){ return this->p; }
+        void byte(unsigned int b){ *this->p++ = static_cast<unsigned char>(b); }
+        void dword(unsigned int d){ for(int i=0; i<4; ++i) this->byte(d >> (i * 8)); }
+        void qword(unsigned long long q){ for(int i=0; i<8; ++i) this->byte(q >> (i * 8)); }
+        // [base + disp32] を指すModR/M (必要ならREXを前に出す)
+        void modrm_mem(int reg, int base, int disp){
+            this->byte(0x80 | ((reg & 7) << 3) | (base & 7));
+            if((base & 7) == rsp) this->byte(0x24); // SIB
+            this->dword(disp);
+        }
+        void rex(bool w, int reg, int base){
+            unsigned int r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+            if(r != 0x40) this->byte(r);
+        }
+        // op r32, [base + disp]
+        void op_load(unsigned int opcode, int reg, int base, int disp){
+            this->rex(false, reg, base);
+            this->byte(opcode);
+            this->modrm_mem(reg, base, disp);
+        }
+        void load32(int reg, int base, int disp){ this->op_load(0x8b, reg, base, disp); }
+        void store32(int base, int disp, int reg){ this->op_load(0x89, reg, base, disp); }
+        void load64(int reg, int base, int disp){
+            this->rex(true, reg, base);
+            this->byte(0x8b);
+            this->modrm_mem(reg, base, disp);
+        }
+        void store_imm32(int base, int disp, unsigned int imm){ // mov dword [base + disp], imm32
+            this->rex(false, 0, base);
+            this->byte(0xc7);
+            this->modrm_mem(0, base, disp);
+            this->dword(imm);
+        }
+        void mov_imm32(int reg, unsigned int imm){ this->byte(0xb8 + reg); this->dword(imm); } // reg < 8
+        void add_counter(unsigned long long* c, unsigned int n){ // *c += n
+            this->byte(0x48); this->byte(0xb8); this->qword(reinterpret_cast<unsigned long long>(c)); // mov rax, imm64
+            this->byte(0x48); this->byte(0x81); this->byte(0x00); this->dword(n); // add qword [rax], imm32
+        }
+        // SSE: prefix 0F op xmm0, [base + disp]
+        void sse_mem(unsigned int prefix, unsigned int opcode, int base, int disp){
+            if(prefix != 0) this->byte(prefix);
+            this->rex(false, 0, base);
+            this->byte(0x0f);
+            this->byte(opcode);
+            this->modrm_mem(0, base, disp);
+        }
+        // 関数呼び出し (mov rax, imm64; call rax)
+        void call(const void* f){
+            this->byte(0x48); this->byte(0xb8); this->qword(reinterpret_cast<unsigned long long>(f));
+            this->byte(0xff); this->byte(0xd0);
+        }
+        // rel32のジャンプ (ジャンプ先を後から埋めるため、rel32の位置を返す)
+        unsigned char* jcc(unsigned int cc){ this->byte(0x0f); this->byte(0x80 | cc); unsigned char* r = this->p; this->dword(0); return r; }
+        void jmp_to(unsigned char* dst){
+            this->byte(0xe9);
+            this->dword(static_cast<unsigned int>(dst - (this->p + 4)));
+        }
+        void bind(unsigned char* rel){ // relの指すジャンプの飛び先を現在位置に
+            int d = static_cast<int>(this->p - (rel + 4));
+            for(int i=0; i<4; ++i) rel[i] = static_cast<unsigned char>(d >> (i * 8));
+        }
+        void prologue(){
+            this->byte(0x53); // push rbx
+            this->byte(0x55); // push rbp
+            this->byte(0x41); this->byte(0x54); // push r12
+            this->byte(0x41); this->byte(0x55); // push r13
+            this->byte(0x48); this->byte(0x83); this->byte(0xec); this->byte(0x08); // sub rsp, 8 (16バイト境界に揃える)
+            this->byte(0x49); this->byte(0x89); this->byte(0xfd); // mov r13, rdi
+            this->load64(rbx, r13, 0);
+            this->load64(rbp, r13, 8);
+            this->load64(r12, r13, 16);
+        }
+        // ctx->pcを設定し、状態コードを返して抜ける
+        void leave(unsigned int next_pc, int status){
+            this->store_imm32(r13, 24, next_pc);
+            this->leave_with_pc_set(status);
+        }
+        void leave_with_pc_set(int status){
+            this->mov_imm32(rax, status);
+            this->byte(0x48); this->byte(0x83); this->byte(0xc4); this->byte(0x08); // add rsp, 8
+            this->byte(0x41); this->byte(0x5d); // pop r13
+            this->byte(0x41); this->byte(0x5c); // pop r12
+            this->byte(0x5d); // pop rbp
+            this->byte(0x5b); // pop rbx
+            this->byte(0xc3); // ret
+        }
+};
+
+// JITのコード領域とキャッシュの初期化・破棄
+inline void jit_flush(){
+    if(jit_code == nullptr){
+        void* m = mmap(nullptr, jit_code_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(m == MAP_FAILED) throw std::runtime_error("could not allocate memory for JIT");
+        jit_code = static_cast<unsigned char*>(m);
+    }
+    jit_code_used = 0;
+    jit_pool.clear();
+    jit_table.assign(code_size, nullptr);
+    jit_hot_count.assign(code_size, 0);
+    jit_pending.assign(code_size, {});
+    jit_flush_requested = false;
+}
+
+// startから始まるブロックをコンパイル
+inline Jit_block* jit_compile(unsigned int start){
+    if(jit_code_used + jit_block_max > jit_code_size) jit_flush(); // コード領域が足りなくなったら作り直す
+
+    using E = Jit_emitter;
+    E e(jit_code + jit_code_used);
+    Jit_block& b = jit_pool.emplace_back();
+    b.code = reinterpret_cast<Jit_func>(e.cur());
+    b.start = start;
+    unsigned int count[op_type_num + 1] = {};
+
+    // レジスタのオフセット
+    auto xi = [](unsigned int i){ return static_cast<int>(i * sizeof(Bit32)); };
+    // eaxをrdに書き込む (x0, f0は0固定なので書き込まない)
+    auto write_int = [&](unsigned int rd){ if(rd != 0) e.store32(E::rbx, xi(rd), E::rax); };
+    auto write_fp = [&](unsigned int rd){ if(rd != 0) e.store32(E::rbp, xi(rd), E::rax); };
+    // eax = rs1 + imm; rax = 符号拡張
+    auto address = [&](unsigned int rs1, int imm){
+        e.load32(E::rax, E::rbx, xi(rs1));
+        e.byte(0x05); e.dword(imm); // add eax, imm32
+        e.byte(0x48); e.byte(0x63); e.byte(0xc0); // movsxd rax, eax
+    };
+    // FPUのヘルパー関数の呼び出し
+    auto call_fpu1 = [&](const void* f, unsigned int rd, unsigned int rs1){
+        e.load32(E::rdi, E::rbp, xi(rs1));
+        e.call(f);
+        write_fp(rd);
+    };
+    auto call_fpu2 = [&](const void* f, unsigned int rd, unsigned int rs1, unsigned int rs2){
+        e.load32(E::rdi, E::rbp, xi(rs1));
+        e.load32(E::rsi, E::rbp, xi(rs2));
+        e.call(f);
+        write_fp(rd);
+    };
+    // SSEの2項演算 (xmm0 = rs1 op rs2)
+    auto sse2 = [&](unsigned int opcode, unsigned int rd, unsigned int rs1, unsigned int rs2){
+        e.sse_mem(0xf3, 0x10, E::rbp, xi(rs1)); // movss xmm0, rs1
+        e.sse_mem(0xf3, opcode, E::rbp, xi(rs2));
+        if(rd != 0) e.sse_mem(0xf3, 0x11, E::rbp, xi(rd)); // movss rd, xmm0
+    };
+    // エラーでの脱出
+    auto leave_error = [&](unsigned int id, int status){
+        e.store_imm32(E::r13, 28, start);
+        e.leave(id, status);
+    };
+    // 命令数のカウント (終端の命令の直前に行う)
+    auto add_counts = [&](){
+        for(unsigned int i=0; i<op_type_num; ++i){
+            if(count[i] > 0) e.add_counter(&op_type_count[i], count[i]);
+        }
+    };
+    // 静的に決まる行き先への脱出
+    auto exit_to = [&](unsigned int next_pc){
+        if(next_pc < code_size && jit_table[next_pc] != nullptr){
+            e.jmp_to(jit_table[next_pc]->body);
+        }else{
+            if(next_pc < code_size) jit_pending[next_pc].emplace_back(e.cur());
+            e.leave(next_pc, jit_status_continue); // 5バイト以上あるので後でjmpに書き換えられる
+        }
+    };
+    #ifdef EXTENDED
+    auto call_branch = [&](unsigned int next_pc, int taken){
+        e.mov_imm32(E::rdi, next_pc);
+        e.mov_imm32(E::rsi, taken);
+        e.call(reinterpret_cast<const void*>(&jit_branch));
+    };
+    #endif
+
+    e.prologue();
+    b.body = e.cur();
+    unsigned int id = start;
+    bool has_term = false;
+    for(; id < code_size && id - start < jit_block_op_max; ++id){
+        const Operation& op = op_list[id];
+        ++count[op.type];
+        if(op.is_conditional() || op.is_unconditional() || op.type == o_si){
+            has_term = true;
+            break;
+        }
+        switch(op.type){
+            case o_add:
+            case o_sub:
+            case o_and:
+                e.load32(E::rax, E::rbx, xi(op.rs1));
+                e.op_load(op.type == o_add ? 0x03 : (op.type == o_sub ? 0x2b : 0x23), E::rax, E::rbx, xi(op.rs2));
+                write_int(op.rd);
+                break;
+            case o_sll:
+            case o_srl:
+            case o_sra:
+                e.load32(E::rax, E::rbx, xi(op.rs1));
+                e.load32(E::rcx, E::rbx, xi(op.rs2));
+                e.byte(0xd3); e.byte(op.type == o_sll ? 0xe0 : (op.type == o_srl ? 0xe8 : 0xf8)); // shl/shr/sar eax, cl
+                write_int(op.rd);
+                break;
+            case o_fabs:
+                if(is_ieee){
+                    e.load32(E::rax, E::rbp, xi(op.rs1));
+                    e.byte(0x25); e.dword(0x7fffffff); // and eax, imm32
+                    write_fp(op.rd);
+                }else{
+                    call_fpu1(reinterpret_cast<const void*>(&jit_fabs), op.rd, op.rs1);
+                }
+                break;
+            case o_fneg:
+                if(is_ieee){
+                    e.load32(E::rax, E::rbp, xi(op.rs1));
+                    e.byte(0x35); e.dword(0x80000000); // xor eax, imm32
+                    write_fp(op.rd);
+                }else{
+                    call_fpu1(reinterpret_cast<const void*>(&jit_fneg), op.rd, op.rs1);
+                }
+                break;
+            case o_fdiv:
+                if(is_ieee) sse2(0x5e, op.rd, op.rs1, op.rs2);
+                else call_fpu2(reinterpret_cast<const void*>(&jit_fdiv), op.rd, op.rs1, op.rs2);
+                break;
+            case o_fsqrt:
+                if(is_ieee){
+                    e.sse_mem(0xf3, 0x51, E::rbp, xi(op.rs1)); // sqrtss xmm0, rs1
+                    if(op.rd != 0) e.sse_mem(0xf3, 0x11, E::rbp, xi(op.rd));
+                }else{
+                    call_fpu1(reinterpret_cast<const void*>(&jit_fsqrt), op.rd, op.rs1);
+                }
+                break;
+            case o_fcvtif:
+                if(is_ieee){
+                    e.sse_mem(0xf3, 0x2a, E::rbp, xi(op.rs1)); // cvtsi2ss xmm0, dword rs1
+                    if(op.rd != 0) e.sse_mem(0xf3, 0x11, E::rbp, xi(op.rd));
+                }else{
+                    call_fpu1(reinterpret_cast<const void*>(&jit_itof), op.rd, op.rs1);
+                }
+                break;
+            case o_fcvtfi:
+                if(is_ieee){ // 最近接丸めで整数にしたものをfloatとして書き込む
+                    e.sse_mem(0xf3, 0x10, E::rbp, xi(op.rs1)); // movss xmm0, rs1
+                    e.byte(0xf3); e.byte(0x0f); e.byte(0x2d); e.byte(0xc0); // cvtss2si eax, xmm0
+                    e.byte(0xf3); e.byte(0x0f); e.byte(0x2a); e.byte(0xc0); // cvtsi2ss xmm0, eax
+                    if(op.rd != 0) e.sse_mem(0xf3, 0x11, E::rbp, xi(op.rd));
+                }else{
+                    call_fpu1(reinterpret_cast<const void*>(&jit_ftoi), op.rd, op.rs1);
+                }
+                break;
+            case o_fmvff:
+                e.load32(E::rax, E::rbp, xi(op.rs1));
+                write_fp(op.rd);
+                break;
+            case o_fadd:
+                if(is_ieee) sse2(0x58, op.rd, op.rs1, op.rs2);
+                else call_fpu2(reinterpret_cast<const void*>(&jit_fadd), op.rd, op.rs1, op.rs2);
+                break;
+            case o_fsub:
+                if(is_ieee) sse2(0x5c, op.rd, op.rs1, op.rs2);
+                else call_fpu2(reinterpret_cast<const void*>(&jit_fsub), op.rd, op.rs1, op.rs2);
+                break;
+            case o_fmul:
+                if(is_ieee) sse2(0x59, op.rd, op.rs1, op.rs2);
+                else call_fpu2(reinterpret_cast<const void*>(&jit_fmul), op.rd, op.rs1, op.rs2);
+                break;
+            case o_sw:
+            case o_fsw:
+                address(op.rs1, op.imm);
+                e.load32(E::rdx, op.type == o_sw ? E::rbx : E::rbp, xi(op.rs2));
+                e.byte(0x41); e.byte(0x89); e.byte(0x14); e.byte(0x84); // mov [r12 + rax*4], edx
+                break;
+            case o_std:
+                e.load32(E::rdi, E::rbx, xi(op.rs2));
+                e.call(reinterpret_cast<const void*>(&jit_std));
+                break;
+            case o_addi:
+            case o_andi:
+                e.load32(E::rax, E::rbx, xi(op.rs1));
+                e.byte(op.type == o_addi ? 0x05 : 0x25); e.dword(op.imm); // add/and eax, imm32
+                write_int(op.rd);
+                break;
+            case o_slli:
+            case o_srli:
+            case o_srai:
+                e.load32(E::rax, E::rbx, xi(op.rs1));
+                e.mov_imm32(E::rcx, op.imm);
+                e.byte(0xd3); e.byte(op.type == o_slli ? 0xe0 : (op.type == o_srli ? 0xe8 : 0xf8));
+                write_int(op.rd);
+                break;
+            case o_lw:
+            case o_flw:
+                address(op.rs1, op.imm);
+                e.byte(0x41); e.byte(0x8b); e.byte(0x04); e.byte(0x84); // mov eax, [r12 + rax*4]
+                if(op.type == o_lw) write_int(op.rd); else write_fp(op.rd);
+                break;
+            case o_lre:
+                e.call(reinterpret_cast<const void*>(&jit_lre));
+                write_int(op.rd);
+                break;
+            case o_lrd:
+                {
+                    // rdi = &reg_int[rd] (x0ならnullptr)
+                    if(op.rd != 0){
+                        e.byte(0x48); e.byte(0x8d); e.modrm_mem(E::rdi, E::rbx, xi(op.rd)); // lea rdi, [rbx + disp]
+                    }else{
+                        e.mov_imm32(E::rdi, 0);
+                    }
+                    e.call(reinterpret_cast<const void*>(&jit_lrd));
+                    e.byte(0x85); e.byte(0xc0); // test eax, eax
+                    unsigned char* ok = e.jcc(0x5); // jnz
+                    leave_error(id, jit_status_lrd);
+                    e.bind(ok);
+                }
+                break;
+            case o_ltf:
+                if(op.rd != 0) e.store_imm32(E::rbx, xi(op.rd), 0);
+                break;
+            case o_lui:
+                if(op.rd != 0) e.store_imm32(E::rbx, xi(op.rd), static_cast<unsigned int>(op.imm << 12));
+                break;
+            case o_fmvif:
+                e.load32(E::rax, E::rbx, xi(op.rs1));
+                write_fp(op.rd);
+                break;
+            case o_fmvfi:
+                e.load32(E::rax, E::rbp, xi(op.rs1));
+                write_int(op.rd);
+                break;
+            default: // 不正な命令 (カウントしない)
+                leave_error(id, jit_status_invalid);
+                goto compiled;
+        }
+    }
+
+    // 終端の命令
+    add_counts();
+    if(!has_term){ // コードの末尾、または命令数の上限
+        exit_to(id);
+    }else{
+        const Operation& op = op_list[id];
+        switch(op.type){
+            case o_beq:
+            case o_blt:
+            case o_fbeq:
+            case o_fblt:
+                {
+                    unsigned char* taken;
+                    if(op.type == o_beq || op.type == o_blt){
+                        e.load32(E::rax, E::rbx, xi(op.rs1));
+                        e.op_load(0x3b, E::rax, E::rbx, xi(op.rs2)); // cmp eax, rs2
+                        taken = e.jcc(op.type == o_beq ? 0x4 : 0xc); // je / jl
+                    }else if(op.type == o_fbeq){
+                        e.sse_mem(0xf3, 0x10, E::rbp, xi(op.rs1)); // movss xmm0, rs1
+                        e.sse_mem(0, 0x2e, E::rbp, xi(op.rs2)); // ucomiss xmm0, rs2
+                        unsigned char* unordered = e.jcc(0xa); // jp (NaNを含む場合は不成立)
+                        taken = e.jcc(0x4); // je
+                        e.bind(unordered);
+                    }else{ // rs1 < rs2 <=> rs2 > rs1 (NaNを含む場合は不成立)
+                        e.sse_mem(0xf3, 0x10, E::rbp, xi(op.rs2));
+                        e.sse_mem(0, 0x2e, E::rbp, xi(op.rs1));
+                        taken = e.jcc(0x7); // ja
+                    }
+                    #ifdef EXTENDED
+                    if(is_gshare_enabled) call_branch(id + 1, 0);
+                    #endif
+                    exit_to(id + 1);
+                    e.bind(taken);
+                    #ifdef EXTENDED
+                    if(is_gshare_enabled) call_branch(id + op.imm, 1);
+                    #endif
+                    exit_to(id + op.imm);
+                }
+                break;
+            case o_jal:
+                if(op.rd != 0) e.store_imm32(E::rbx, xi(op.rd), id + 1);
+                if(op.is_exit()){
+                    e.leave(id, jit_status_exit);
+                }else{
+                    exit_to(id + op.imm);
+                }
+                break;
+            case o_jalr:
+                e.load32(E::rax, E::rbx, xi(op.rs1));
+                e.store32(E::r13, 24, E::rax);
+                if(op.rd != 0) e.store_imm32(E::rbx, xi(op.rd), id + 1);
+                e.leave_with_pc_set(jit_status_continue);
+                break;
+            default: // o_si
+                address(op.rs1, op.imm);
+                e.byte(0x89); e.byte(0xc7); // mov edi, eax
+                e.load32(E::rsi, E::rbx, xi(op.rs2));
+                e.call(reinterpret_cast<const void*>(&jit_si));
+                e.leave(id + 1, jit_status_continue);
+                break;
+        }
+    }
+
+    compiled:
+    jit_code_used = e.cur() - jit_code;
+    jit_table[start] = &b;
+
+    // このブロックへの出口を直接のジャンプに書き換える
+    for(unsigned char* stub : jit_pending[start]){
+        E patch(stub);
+        patch.jmp_to(b.body);
+    }
+    jit_pending[start].clear();
+    return &b;
+}
+
+// 終了状態になるまでJITで実行
+int exec_jit(){
+    // op_listはdebugモードのdo/continueでsiにより書き換えられている可能性があるので、毎回キャッシュを作り直す
+    jit_flush();
+    if(pc >= code_size) return sim_state_end;
+
+    Jit_context ctx;
+    while(true){
+        Jit_block* b = jit_table[pc];
+        if(b == nullptr){
+            if(++jit_hot_count[pc] < jit_threshold){ // まだ十分に実行されていないブロックはexec_opで実行
+                while(true){
+                    const Operation& op = op_list[pc];
+                    bool is_term = op.is_conditional() || op.is_unconditional() || op.type == o_si;
+                    bool is_si = op.type == o_si;
+                    if(exec_op() == sim_state_end) return sim_state_end;
+                    if(is_si) jit_flush(); // 書き換えられた命令を含むブロックを作り直す
+                    if(is_term) break;
+                }
+                continue;
+            }
+            b = jit_compile(pc);
+        }
+
+        ctx.reg_int = reg_int.data_ptr();
+        ctx.reg_fp = reg_fp.data_ptr();
+        ctx.mem = memory.data_ptr();
+        int status = b->code(&ctx);
+
+        if(status == jit_status_continue || status == jit_status_exit){
+            pc = ctx.pc;
+            if(status == jit_status_exit || pc >= code_size) return sim_state_end;
+            if(jit_flush_requested) jit_flush();
+        }else{
+            // エラーの直前までの実行を反映
+            pc = ctx.pc;
+            for(unsigned int id=ctx.start; id<pc; ++id) ++op_type_count[op_list[id].type];
+            if(status == jit_status_lrd){
+                throw std::runtime_error("receive buffer is empty [lrd] (at pc " + std::to_string(pc) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(pc))) : "") + ")");
+            }else{
+                throw std::runtime_error("error in executing the code (at pc " + std::to_string(pc) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(pc))) : "") + ")");
+            }
+        }
+    }
+}
@@ -0,0 +1,292 @@
+#pragma once
+#include <common.hpp>
+#include <unit.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <boost/bimap/bimap.hpp>
+#include <mapped_file.hpp>
+
+/* typedef宣言 */
+// boost::bimaps関連の略記
+typedef boost::bimaps::bimap<std::string, unsigned int> bimap_t;
+typedef bimap_t::value_type bimap_value_t;
+typedef boost::bimaps::bimap<unsigned int, int> bimap_t2;
+typedef bimap_t2::value_type bimap_value_t2;
+
+/* .simimgのヘッダ (以降、命令列・行番号・ラベル・ブレークポイント・文字列・プリロードデータの順に並ぶ) */
+inline constexpr char image_magic[8] = {'S', 'I', 'M', 'I', 'M', 'G', '\0', '\0'};
+inline constexpr unsigned int image_version = 1; // Operationの配置を変えたら上げること
+struct Image_header{
+    char magic[8];
+    unsigned int version;
+    unsigned int code_size; // 次の命令id
+    unsigned int op_num; // op_listの要素数
+    int last_line; // 最後の命令の行番号
+    unsigned int line_num; // id_to_lineの要素数
+    unsigned int label_num; // label_to_idの要素数
+    unsigned int bp_num; // bp_to_idの要素数
+    unsigned int string_size; // ラベル名などの文字列の合計長
+    unsigned long long preload_size; // プリロードデータのバイト数
+};
+struct Image_line{ // 命令idの昇順
+    unsigned int id;
+    int line;
+};
+struct Image_name{ // 名前の昇順
+    unsigned int id;
+    unsigned int offset; // 文字列領域での位置
+    unsigned int length;
+};
+
+/* extern宣言 */
+extern std::vector<Operation> op_list;
+extern bool is_debug;
+extern std::string head;
+extern bimap_t bp_to_id;
+extern bimap_t label_to_id;
+extern bimap_t2 id_to_line;
+
+/* プロトタイプ宣言 */
+void preload_data(const std::string&, TransmissionQueue&); // バッファのデータのプリロード
+unsigned int load_code(const std::string&, bool, unsigned int, int&); // プログラムを読み込んでop_listに追加
+bool scan_code_word(std::string_view, unsigned int&);
+bool scan_annotation(std::string_view, int&, std::string_view&, std::string_view&);
+std::size_t scan_name(std::string_view, std::size_t);
+void write_image(const std::string&, unsigned int, int, const std::string&); // .simimgへの書き出し
+unsigned int load_image(const std::string&, int&, TransmissionQueue*); // .simimgの読み込み
+
+
+// バッファのデータのプリロード (1バイトを1要素として積む)
+inline void preload_data(const std::string& filename, TransmissionQueue& buffer){
+    Mapped_file file(filename);
+    buffer.push(file.data, file.size);
+}
+
+// プログラムを読み込んでop_listに追加し、次の命令idを返す (last_lineには最後の命令の行番号が入る)
+inline unsigned int load_code(const std::string& filename, bool is_bin, unsigned int code_id, int& last_line){
+    Mapped_file file(filename);
+    const char* data = reinterpret_cast<const char*>(file.data);
+
+    if(is_bin){ // 4バイトずつbig endianで命令を読む
+        std::size_t word_num = file.size / 4;
+        op_list.reserve(op_list.size() + word_num);
+        for(std::size_t i=0; i<word_num; ++i){
+            const unsigned char* p = file.data + i * 4;
+            unsigned int code = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            op_list.emplace_back(Operation(static_cast<int>(code)));
+            ++code_id;
+        }
+        return code_id;
+    }
+
+    op_list.reserve(op_list.size() + file.size / 33);
+    std::size_t pos = 0;
+    while(pos < file.size){
+        // 1行を切り出す
+        const char* newline = static_cast<const char*>(std::memchr(data + pos, '\n', file.size - pos));
+        std::size_t tail = newline == nullptr ? file.size : newline - data;
+        std::string_view line(data + pos, tail - pos);
+        pos = tail + 1;
+        if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+        // 空行は無視
+        if(line.find_first_not_of(" \t\v\f") == std::string_view::npos) continue;
+
+        unsigned int code;
+        if(!scan_code_word(line, code)){
+            std::cerr << head_error << "could not parse the code" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        op_list.emplace_back(Operation(static_cast<int>(code)));
+
+        // ラベル・ブレークポイントの処理
+        if(line.size() > 32){
+            if(!is_debug){ // デバッグモードでないのにラベルやブレークポイントの情報が入っている場合エラー
+                std::cerr << head_error << "could not parse the code (maybe it is encoded in debug-style)" << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            int line_num;
+            std::string_view label, bp;
+            if(!scan_annotation(line.substr(32), line_num, label, bp)){
+                std::cerr << head_error << "could not parse the code" << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            id_to_line.insert(bimap_value_t2(code_id, line_num));
+            if(!label.empty()) label_to_id.insert(bimap_value_t(std::string(label), code_id));
+            if(!bp.empty()) bp_to_id.insert(bimap_value_t(std::string(bp), code_id));
+            last_line = line_num;
+        }
+
+        ++code_id;
+    }
+
+    return code_id;
+}
+
+// 行頭の32文字を0/1の列として読む
+inline bool scan_code_word(std::string_view s, unsigned int& code){
+    if(s.size() < 32) return false;
+    code = 0;
+    for(std::size_t i=0; i<32; ++i){
+        if(s[i] != '0' && s[i] != '1') return false;
+        code = (code << 1) | (s[i] == '1');
+    }
+    return true;
+}
+
+// ".dbg"の注釈 "@行番号[#ラベル][!ブレークポイント]" を読む
+inline bool scan_annotation(std::string_view s, int& line_num, std::string_view& label, std::string_view& bp){
+    std::size_t i = 0;
+    if(s.empty() || s[i] != '@') return false;
+    ++i;
+
+    bool is_negative = i < s.size() && s[i] == '-';
+    if(is_negative) ++i;
+    std::size_t start = i;
+    int v = 0;
+    while(i < s.size() && '0' <= s[i] && s[i] <= '9'){
+        v = v * 10 + (s[i] - '0');
+        ++i;
+    }
+    if(i == start) return false;
+    line_num = is_negative ? -v : v;
+
+    label = bp = std::string_view();
+    if(i < s.size() && s[i] == '#'){
+        start = ++i;
+        i = scan_name(s, i);
+        if(i == start) return false;
+        label = s.substr(start, i - start);
+    }
+    if(i < s.size() && s[i] == '!'){
+        start = ++i;
+        i = scan_name(s, i);
+        if(i == start) return false;
+        bp = s.substr(start, i - start);
+    }
+
+    return i == s.size();
+}
+
+// 位置iから始まるラベル名([a-zA-Z_][\w.]*)を読み、その直後の位置を返す
+inline std::size_t scan_name(std::string_view s, std::size_t i){
+    auto is_alpha = [](char c){ return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_'; };
+    auto is_digit = [](char c){ return '0' <= c && c <= '9'; };
+    if(i >= s.size() || !is_alpha(s[i])) return i;
+    ++i;
+    while(i < s.size() && (is_alpha(s[i]) || is_digit(s[i]) || s[i] == '.')) ++i;
+    return i;
+}
+
+
+// 読み込み済みのプログラムを.simimgとして書き出す (preload_filenameが空でなければプリロードデータも含める)
+inline void write_image(const std::string& filename, unsigned int code_size, int last_line, const std::string& preload_filename){
+    Image_header header;
+    std::memcpy(header.magic, image_magic, sizeof(image_magic));
+    header.version = image_version;
+    header.code_size = code_size;
+    header.op_num = op_list.size();
+    header.last_line = last_line;
+
+    std::vector<Image_line> lines;
+    lines.reserve(id_to_line.size());
+    for(auto& x : id_to_line.left) lines.push_back({x.first, x.second});
+
+    std::string strings;
+    auto flatten = [&](bimap_t& names){
+        std::vector<Image_name> res;
+        res.reserve(names.size());
+        for(auto& x : names.left){
+            res.push_back({x.second, static_cast<unsigned int>(strings.size()), static_cast<unsigned int>(x.first.size())});
+            strings += x.first;
+        }
+        return res;
+    };
+    std::vector<Image_name> labels = flatten(label_to_id);
+    std::vector<Image_name> bps = flatten(bp_to_id);
+
+    header.line_num = lines.size();
+    header.label_num = labels.size();
+    header.bp_num = bps.size();
+    header.string_size = strings.size();
+    header.preload_size = 0;
+    std::unique_ptr<Mapped_file> preload_file;
+    if(preload_filename != ""){
+        preload_file = std::make_unique<Mapped_file>(preload_filename);
+        header.preload_size = preload_file->size;
+    }
+
+    std::ofstream output_file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!output_file){
+        std::cerr << head_error << "could not open " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    output_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output_file.write(reinterpret_cast<const char*>(op_list.data()), op_list.size() * sizeof(Operation));
+    output_file.write(reinterpret_cast<const char*>(lines.data()), lines.size() * sizeof(Image_line));
+    output_file.write(reinterpret_cast<const char*>(labels.data()), labels.size() * sizeof(Image_name));
+    output_file.write(reinterpret_cast<const char*>(bps.data()), bps.size() * sizeof(Image_name));
+    output_file.write(strings.data(), strings.size());
+    if(preload_file) output_file.write(reinterpret_cast<const char*>(preload_file->data), preload_file->size);
+}
+
+// .simimgを読み込んでop_listなどを復元し、次の命令idを返す (bufferがnullptrでなければ含まれるプリロードデータを積む)
+inline unsigned int load_image(const std::string& filename, int& last_line, TransmissionQueue* buffer){
+    Mapped_file file(filename);
+    Image_header header;
+    if(file.size < sizeof(header)){
+        std::cerr << head_error << "invalid image file: " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    std::memcpy(&header, file.data, sizeof(header));
+    if(std::memcmp(header.magic, image_magic, sizeof(image_magic)) != 0 || header.version != image_version){
+        std::cerr << head_error << "invalid image file: " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    std::size_t expected_size = sizeof(header)
+        + static_cast<std::size_t>(header.op_num) * sizeof(Operation)
+        + static_cast<std::size_t>(header.line_num) * sizeof(Image_line)
+        + static_cast<std::size_t>(header.label_num + header.bp_num) * sizeof(Image_name)
+        + header.string_size + header.preload_size;
+    if(file.size != expected_size){
+        std::cerr << head_error << "invalid image file: " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    if(is_debug && header.op_num > 0 && header.line_num == 0){
+        std::cerr << head_error << "the image has no debug information (convert from .dbg with -d)" << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    // 命令列はデコード済みのものをそのままコピー
+    const unsigned char* p = file.data + sizeof(header);
+    op_list.resize(header.op_num);
+    std::memcpy(op_list.data(), p, header.op_num * sizeof(Operation));
+    p += header.op_num * sizeof(Operation);
+
+    const Image_line* lines = reinterpret_cast<const Image_line*>(p);
+    p += header.line_num * sizeof(Image_line);
+    const Image_name* labels = reinterpret_cast<const Image_name*>(p);
+    p += header.label_num * sizeof(Image_name);
+    const Image_name* bps = reinterpret_cast<const Image_name*>(p);
+    p += header.bp_num * sizeof(Image_name);
+    const char* strings = reinterpret_cast<const char*>(p);
+    p += header.string_size;
+
+    if(is_debug){ // ソート済みなので末尾に挿入していく
+        for(unsigned int i=0; i<header.line_num; ++i) id_to_line.left.insert(id_to_line.left.end(), bimap_t2::left_value_type(lines[i].id, lines[i].line));
+        for(unsigned int i=0; i<header.label_num; ++i) label_to_id.left.insert(label_to_id.left.end(), bimap_t::left_value_type(std::string(strings + labels[i].offset, labels[i].length), labels[i].id));
+        for(unsigned int i=0; i<header.bp_num; ++i) bp_to_id.left.insert(bp_to_id.left.end(), bimap_t::left_value_type(std::string(strings + bps[i].offset, bps[i].length), bps[i].id));
+    }
+    last_line = header.last_line;
+
+    if(buffer != nullptr && header.preload_size > 0){
+        buffer->push(p, header.preload_size);
+        std::cout << head << "preloaded data to the receive-buffer from " + filename << std::endl;
+    }
+
+    return header.code_size;
+}
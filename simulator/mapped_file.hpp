@@ -0,0 +1,53 @@
+#pragma once
+#include <common.hpp>
+#include <string>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* mmapで読み込んだファイル */
+class Mapped_file{
+    public:
+        const unsigned char* data;
+        std::size_t size;
+        Mapped_file(const std::string&);
+        ~Mapped_file();
+        Mapped_file(const Mapped_file&) = delete;
+        Mapped_file& operator=(const Mapped_file&) = delete;
+};
+
+
+/* class Mapped_file */
+inline Mapped_file::Mapped_file(const std::string& filename){
+    this->data = nullptr;
+    this->size = 0;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd == -1){
+        std::cerr << head_error << "could not open " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        std::cerr << head_error << "could not open " << filename << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    this->size = st.st_size;
+    if(this->size > 0){ // 空のファイルはmmapできない
+        void* p = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED){
+            std::cerr << head_error << "could not map " << filename << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        madvise(p, this->size, MADV_SEQUENTIAL);
+        this->data = static_cast<const unsigned char*>(p);
+    }
+    close(fd);
+}
+
+inline Mapped_file::~Mapped_file(){
+    if(this->data != nullptr) munmap(const_cast<unsigned char*>(this->data), this->size);
+}
@@ -5,11 +5,14 @@ inline constexpr int op_type_num = 39;
 inline constexpr unsigned long long max_op_count = 10000000000;
 inline constexpr int stack_border = 1000;
 
+inline constexpr unsigned int jit_threshold = 2; // JITでコンパイルするまでの実行回数
+
 inline constexpr unsigned int pipelined_fpu_stage_num = 3;
 
 constexpr unsigned int addr_width = 25;
 inline constexpr unsigned int index_width = 12;
 inline constexpr unsigned int offset_width = 4;
+inline constexpr unsigned int cache_way_num = 1; // 連想度 (1ならダイレクトマップ)
 // tag_width = 9
 
 inline constexpr unsigned int gshare_width = 12;
@@ -20,3 +23,38 @@ inline constexpr unsigned int transmission_speed = baud_rate / 10 * 8;
 inline constexpr unsigned int minrt_filesize = 48084;
 inline constexpr double transmission_time = static_cast<double>(minrt_filesize) / static_cast<double>(baud_rate);
 inline constexpr unsigned int cycles_when_missed = 70;
+
+// UARTのモデル (sim2の--uart)
+inline constexpr double uart_cycles_per_byte = static_cast<double>(frequency) * 10.0 / static_cast<double>(baud_rate); // 1バイト(スタート・ストップビットを含めて10ビット)の送受信にかかるクロック数
+inline constexpr unsigned int uart_send_fifo_size = 256; // 送信用のfifoの大きさ (これ以上溜まるとltfがfullを返す)
+
+// sim+とserverの間の通信
+inline constexpr unsigned char protocol_raw_tag = 0xff; // 接続の先頭がこのバイトなら長さ付きのバイナリ形式 (それ以外は32文字のテキスト形式)
+inline constexpr unsigned int receive_chunk_size = 65536; // 1回のrecvで読み込む最大のバイト数
+inline constexpr unsigned int bulk_chunk_size = 1 << 20; // serverがファイルを送る際の1フレームの最大のバイト数
+inline constexpr unsigned char protocol_version = 2; // sim+からserverへのバイナリ形式のバージョン (2: 返答にセッションIDを含む)
+inline constexpr unsigned int protocol_window = 65536; // 受信確認を待たずに送信できる最大のバイト数
+inline constexpr int protocol_greeting_delay = 50; // serverはこの時間(ms)クライアントから何も届かなければ挨拶を送る
+inline constexpr int protocol_negotiation_timeout = 1000; // sim+はこの時間(ms)挨拶が届かなければ従来の形式で送る
+inline constexpr unsigned int send_batch_threshold = 4096; // 送信スレッドはこのバイト数溜まるまで眠る (バイナリ形式の場合)
+inline constexpr int send_flush_interval = 10; // 溜まっていなくてもこの時間(ms)が経過すれば送信する
+
+// stdの出力先 (sink.hpp)
+inline constexpr unsigned int sink_buffer_size = 65536; // このバイト数溜まるごとに書き出す
+inline constexpr int sink_flush_interval = 100; // PPMの場合、1行揃った時点でこの時間(ms)以上書き出していなければ書き出す
+
+// デバッグモードの逆実行 (reverse.hpp)
+inline constexpr unsigned long long checkpoint_interval = 1 << 20; // チェックポイントを取る間隔(命令数)の初期値
+inline constexpr unsigned int checkpoint_max = 64; // 保持するチェックポイントの最大数 (超えたら間引いて間隔を倍にする)
+inline constexpr unsigned int undo_log_size = 1 << 20; // undoログに残す命令数
+
+// サンプリングによるプロファイラ (profiler.hpp)
+inline constexpr unsigned long long sample_interval = 1009; // サンプリングの間隔(命令数)の既定値 (ループの周期と揃わないように素数にしておく)
+inline constexpr unsigned long long sample_timer_interval = 1000; // タイマでサンプリングする場合の間隔(us)の既定値
+inline constexpr unsigned long long sample_timer_check_interval = 64; // タイマでサンプリングする場合に、割り込みの有無を確認する間隔(命令数)
+inline constexpr unsigned int sample_report_top = 20; // 終了時に画面に表示するラベルの数
+
+// キャッシュの構成の一括解析 (cache_analysis.hpp)
+inline constexpr unsigned int analysis_offset_width_max = 5; // ブロックの大きさは1~2^5ワード
+inline constexpr unsigned int analysis_index_width_max = 14; // セット数は1~2^14
+inline constexpr unsigned int analysis_way_max = 16; // 連想度は1~16 (2の冪)
@@ -0,0 +1,289 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <loader.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <csignal>
+#include <sys/time.h>
+
+/* ラベル名の解決 */
+// pcを含む関数(pc以前で最も近いラベル)の名前 (ラベルの情報がなければpcをそのまま使う)
+inline std::string label_of_pc(unsigned int pc){
+    auto it = label_to_id.right.upper_bound(pc);
+    if(it == label_to_id.right.begin()) return "pc_" + std::to_string(pc);
+    return (--it)->second;
+}
+
+/* 関数呼び出しの追跡 (シャドウスタック) */
+// rdが0でないjal/jalrを呼び出しとみなしてpushし、戻り先がスタック上のいずれかの戻りアドレスと一致するjalrを復帰とみなしてpopする
+// (呼び出し規約に依存しないように、x0へのjalrでも戻りアドレスと一致しなければ単なる間接ジャンプとして扱う)
+class Call_stack{
+    public:
+        struct Frame{
+            unsigned int entry; // 呼び出された関数の先頭のpc
+            unsigned int ret; // 戻りアドレス
+        };
+        std::vector<Frame> frames; // 先頭はプログラムの開始位置 (popされない)
+        void reset(unsigned int entry){
+            this->frames.clear();
+            this->frames.push_back({entry, static_cast<unsigned int>(-1)});
+        }
+        bool empty() const {
+            return this->frames.empty();
+        }
+        // 戻り先がnew_pcであるフレームを上から探し、その位置+1を返す (見つからなければ0)
+        std::size_t find_return(unsigned int new_pc) const {
+            for(std::size_t i=this->frames.size(); i>1; --i){
+                if(this->frames[i - 1].ret == new_pc) return i;
+            }
+            return 0;
+        }
+        // 実行したjal/jalrに応じてスタックを更新する (old_pcは実行前、new_pcは実行後のpc)
+        void update(Otype type, unsigned int rd, unsigned int old_pc, unsigned int new_pc){
+            if(rd != 0){
+                this->frames.push_back({new_pc, old_pc + 1});
+            }else if(type == Otype::o_jalr){
+                std::size_t i = this->find_return(new_pc);
+                if(i > 0) this->frames.resize(i - 1);
+            }
+        }
+};
+
+/* 関数ごとの実行量の集計 (コールグラフ) */
+// Call_stackと同じ規則で呼び出し・復帰を追跡し、関数(呼び出し先のpc)ごとに呼び出し回数と実行量を数える
+// 実行量の単位は呼び出し側が決める (simでは実行命令数、sim2ではクロック数)
+// - exclusive: その関数自身がスタックの一番上にあった間の実行量
+// - inclusive: その関数が呼ばれてから戻るまでの実行量 (再帰呼び出しの場合は一番外側の呼び出しのみで数える)
+class Call_graph_profiler{
+    private:
+        struct Frame{
+            unsigned long long start; // 呼び出された時点
+            bool is_outermost; // 再帰呼び出しの一番外側
+        };
+        struct Function{
+            unsigned long long calls = 0;
+            unsigned long long inclusive = 0;
+            unsigned long long exclusive = 0;
+            unsigned int depth = 0; // スタック上にある数
+        };
+        Call_stack stack;
+        std::vector<Frame> frames; // stack.framesと対応
+        std::unordered_map<unsigned int, Function> functions;
+        std::map<std::pair<unsigned int, unsigned int>, unsigned long long> edges; // (呼び出し元, 呼び出し先)ごとの呼び出し回数
+        unsigned long long last = 0; // 最後にexclusiveを加算した時点
+        unsigned long long total = 0;
+        void charge(unsigned long long now){
+            this->functions[this->stack.frames.back().entry].exclusive += now - this->last;
+            this->last = now;
+        }
+        void push(unsigned int entry, unsigned int ret, unsigned long long now){
+            if(!this->stack.empty()) ++this->edges[{this->stack.frames.back().entry, entry}];
+            this->stack.frames.push_back({entry, ret});
+            Function& f = this->functions[entry];
+            ++f.calls;
+            this->frames.push_back({now, f.depth == 0});
+            ++f.depth;
+        }
+        void pop(unsigned long long now){
+            Function& f = this->functions[this->stack.frames.back().entry];
+            if(this->frames.back().is_outermost) f.inclusive += now - this->frames.back().start;
+            --f.depth;
+            this->stack.frames.pop_back();
+            this->frames.pop_back();
+        }
+    public:
+        // プログラムの開始位置を一番外側の関数とする
+        void reset(unsigned int entry, unsigned long long now){
+            this->stack.frames.clear();
+            this->frames.clear();
+            this->functions.clear();
+            this->edges.clear();
+            this->last = now;
+            this->total = 0;
+            this->push(entry, static_cast<unsigned int>(-1), now);
+        }
+        // 実行したjal/jalrを渡す (nowはその命令を含めた実行量)
+        void update(Otype type, unsigned int rd, unsigned int old_pc, unsigned int new_pc, unsigned long long now){
+            if(rd != 0){
+                this->charge(now);
+                this->push(new_pc, old_pc + 1, now);
+            }else if(type == Otype::o_jalr){
+                std::size_t i = this->stack.find_return(new_pc);
+                if(i == 0) return;
+                this->charge(now);
+                while(this->stack.frames.size() >= i) this->pop(now);
+            }
+        }
+        // 実行終了時に、スタックに残っている関数を全て戻ったものとして集計する
+        void finish(unsigned long long now){
+            if(this->stack.empty()) return;
+            this->charge(now);
+            while(!this->stack.empty()) this->pop(now);
+            this->total = now;
+        }
+        // 関数ごとの集計 (inclusiveの降順)
+        std::string functions_to_csv() const {
+            std::vector<std::pair<unsigned int, Function>> sorted(this->functions.begin(), this->functions.end());
+            std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b){ return a.second.inclusive != b.second.inclusive ? a.second.inclusive > b.second.inclusive : a.first < b.first; });
+            std::stringstream ss;
+            ss << "function,pc,calls,inclusive,exclusive,inclusive_ratio,exclusive_ratio" << std::endl;
+            for(auto& [entry, f] : sorted){
+                ss << label_of_pc(entry) << "," << entry << "," << f.calls << "," << f.inclusive << "," << f.exclusive << ",";
+                ss << static_cast<double>(f.inclusive) / this->total << "," << static_cast<double>(f.exclusive) / this->total << std::endl;
+            }
+            return ss.str();
+        }
+        // 呼び出し関係ごとの呼び出し回数
+        std::string edges_to_csv() const {
+            std::stringstream ss;
+            ss << "caller,callee,calls" << std::endl;
+            for(auto& [e, n] : this->edges){
+                ss << label_of_pc(e.first) << "," << label_of_pc(e.second) << "," << n << std::endl;
+            }
+            return ss.str();
+        }
+        // 2つの表をファイルに書き出す
+        void write(const std::string& output_filename, const std::string& output_filename_edges) const {
+            std::ofstream output_file(output_filename);
+            if(!output_file){
+                std::cerr << head_error << "could not open " << output_filename << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            output_file << this->functions_to_csv();
+            std::cout << head << "call graph (per function): " << output_filename << std::endl;
+
+            std::ofstream output_file_edges(output_filename_edges);
+            if(!output_file_edges){
+                std::cerr << head_error << "could not open " << output_filename_edges << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            output_file_edges << this->edges_to_csv();
+            std::cout << head << "call graph (per call site): " << output_filename_edges << std::endl;
+        }
+};
+
+/* サンプリングによるプロファイラ */
+// 一定の命令数ごと(またはプロセスのCPU時間によるタイマ割り込みごと)にpcを記録する
+// 実行側(run_sampling)は、interval命令(タイマの場合はsample_timer_check_interval命令)を続けて実行するごとにpoll()を呼ぶ
+// 記録はpcごとのヒストグラムで、ラベルごとの集計は出力時に行う
+// スタックも記録する場合は、呼び出し元から順に並べた関数の列ごとに回数を数え、flame graph用のfolded形式で出力する
+inline volatile std::sig_atomic_t is_sample_requested = 0;
+class Sampling_profiler{
+    private:
+        std::vector<unsigned long long> pc_samples;
+        std::map<std::vector<unsigned int>, unsigned long long> stack_samples; // キーはスタック上の関数の先頭のpc
+        unsigned long long sample_num = 0;
+        static void on_timer(int){
+            is_sample_requested = 1;
+        }
+    public:
+        bool is_enabled = false;
+        bool is_timer = false; // タイマ割り込みでサンプリングする
+        bool is_stack = false; // スタックも記録する
+        unsigned long long interval = sample_interval; // 命令数 (タイマの場合はマイクロ秒)
+        Call_stack stack;
+        void reset(){
+            this->pc_samples.assign(op_list.size(), 0);
+            this->stack_samples.clear();
+            this->sample_num = 0;
+            this->stack.frames.clear();
+        }
+        // runの開始時に呼ぶ
+        void start(unsigned int pc){
+            if(this->pc_samples.size() < op_list.size()) this->pc_samples.resize(op_list.size(), 0);
+            if(this->is_stack && this->stack.empty()) this->stack.reset(pc);
+            if(this->is_timer){
+                struct sigaction sa = {};
+                sa.sa_handler = on_timer;
+                sa.sa_flags = SA_RESTART; // 通信スレッドのシステムコールを中断させない
+                sigaction(SIGPROF, &sa, nullptr);
+                struct itimerval t = {};
+                t.it_interval.tv_sec = t.it_value.tv_sec = this->interval / 1000000;
+                t.it_interval.tv_usec = t.it_value.tv_usec = this->interval % 1000000;
+                setitimer(ITIMER_PROF, &t, nullptr);
+            }
+        }
+        void stop(){
+            if(this->is_timer){
+                struct itimerval t = {};
+                setitimer(ITIMER_PROF, &t, nullptr);
+            }
+        }
+        // 続けて実行する命令数
+        unsigned long long chunk() const {
+            return this->is_timer ? sample_timer_check_interval : this->interval;
+        }
+        void poll(unsigned int pc){
+            if(this->is_timer){
+                if(!is_sample_requested) return;
+                is_sample_requested = 0;
+            }
+            this->sample(pc);
+        }
+        void sample(unsigned int pc){
+            ++this->sample_num;
+            if(pc < this->pc_samples.size()) ++this->pc_samples[pc];
+            if(this->is_stack){
+                std::vector<unsigned int> key(this->stack.frames.size());
+                for(std::size_t i=0; i<key.size(); ++i) key[i] = this->stack.frames[i].entry;
+                ++this->stack_samples[key];
+            }
+        }
+        // ラベルごとの集計を出力し(上位top件は画面にも表示)、スタックを記録した場合はfolded形式のファイルも書き出す
+        void report(const std::string& basename, unsigned int top) const {
+            std::map<std::string, unsigned long long> label_samples;
+            for(unsigned int i=0; i<this->pc_samples.size(); ++i){
+                if(this->pc_samples[i] > 0) label_samples[label_of_pc(i)] += this->pc_samples[i];
+            }
+            std::vector<std::pair<std::string, unsigned long long>> sorted(label_samples.begin(), label_samples.end());
+            std::stable_sort(sorted.begin(), sorted.end(), [](auto& a, auto& b){ return a.second > b.second; });
+
+            std::string output_filename = basename + "_sample.csv";
+            std::ofstream output_file(output_filename);
+            if(!output_file){
+                std::cerr << head_error << "could not open " << output_filename << std::endl;
+                return;
+            }
+            std::stringstream ss;
+            ss << "label,samples,ratio" << std::endl;
+            for(auto& [label, n] : sorted){
+                ss << label << "," << n << "," << static_cast<double>(n) / this->sample_num << std::endl;
+            }
+            output_file << ss.str();
+
+            std::cout << head << "samples: " << this->sample_num << " (every " << this->interval << (this->is_timer ? " us of CPU time" : " operations") << ")" << std::endl;
+            std::stringstream ss_top;
+            for(unsigned int i=0; i<sorted.size() && i<top; ++i){
+                ss_top << "  " << std::setw(6) << std::fixed << std::setprecision(2) << 100.0 * sorted[i].second / this->sample_num << "%  " << sorted[i].first << std::endl;
+            }
+            std::cout << ss_top.str();
+            std::cout << head << "sampling profile: " << output_filename << std::endl;
+
+            if(this->is_stack){
+                std::string output_filename_folded = basename + "_folded.txt";
+                std::ofstream output_file_folded(output_filename_folded);
+                if(!output_file_folded){
+                    std::cerr << head_error << "could not open " << output_filename_folded << std::endl;
+                    return;
+                }
+                std::stringstream ss_folded;
+                for(auto& [key, n] : this->stack_samples){
+                    for(std::size_t i=0; i<key.size(); ++i) ss_folded << (i == 0 ? "" : ";") << label_of_pc(key[i]);
+                    ss_folded << " " << n << std::endl;
+                }
+                output_file_folded << ss_folded.str();
+                std::cout << head << "folded stacks (for flamegraph.pl): " << output_filename_folded << std::endl;
+            }
+        }
+};
+
+extern Sampling_profiler sampling_profiler;
+extern Call_graph_profiler call_graph;
@@ -0,0 +1,207 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <sim.hpp>
+#include <snapshot.hpp>
+#include <vector>
+#include <memory>
+#include <optional>
+
+/* 逆実行 (デバッグモードのundo, reverse-continue) */
+// - 一定の命令数ごとにSnapshotを取得する (最大checkpoint_max個で、超えたら1つおきに間引いて間隔を倍にする)
+// - 1命令ごとに、書き換える前のレジスタ・メモリの値を最新のundo_log_size命令分だけ記録する
+// undoでは、戻り先がログの範囲内ならログを逆順に適用し、範囲外なら戻り先以前で最新のチェックポイントから再実行する
+// lrd/std/siは送受信バッファや命令列を変えるのでログでは戻せず、それより前に戻る場合はチェックポイントから再実行する
+// 記録はdo/until/continueなどで1命令ずつ実行する場合のみ行う (runで実行した区間は、チェックポイントからの再実行で補う)
+class History{
+    private:
+        struct Entry{
+            unsigned int pc; // 実行前のPC
+            Otype type;
+            bool is_barrier; // ログでは戻せない命令
+            bool is_fp; // 書き込んだのが浮動小数点数レジスタか
+            bool has_mem; // メモリに書き込んだか
+            unsigned int rd; // 書き込んだレジスタ (x0の場合は書き戻しても影響がない)
+            Bit32 rd_old;
+            int mem_addr;
+            Bit32 mem_old;
+        };
+        std::vector<Entry> log; // リングバッファ (i番目の命令はlog[i % undo_log_size])
+        unsigned long long log_begin = 0; // ログに残っている最初の命令の番号
+        unsigned long long log_end = 0; // ログの最後の命令の次の番号 (現在の実行命令数と一致しなければ、記録しない実行があった)
+        unsigned long long barrier_end = 0; // ログでは戻せない最後の命令の次の番号
+        unsigned long long irreversible_end = 0; // これより前には戻れない (送受信済みのデータがある場合)
+        std::vector<std::unique_ptr<Snapshot>> checkpoints; // 実行命令数の昇順 (読み込み直後の状態は含まない)
+        std::vector<std::unique_ptr<Snapshot>> pool; // 間引いたチェックポイントの領域を再利用する
+        unsigned long long interval = checkpoint_interval;
+        unsigned long long next_checkpoint = checkpoint_interval;
+        bool is_loggable = true; // キャッシュ・分岐予測・統計の情報はログでは戻せないので、それらが有効なら常に再実行する
+        Snapshot* initial = nullptr;
+
+        // 送受信済みのデータは取り消せないので、それを含む命令より前には戻らない (sim+のlrd/std、出力を直接書き出している場合のstd)
+        static bool is_irreversible(Otype type){
+            #ifdef EXTENDED
+            return type == Otype::o_lrd || type == Otype::o_std;
+            #else
+            return type == Otype::o_std && output_sink.is_open();
+            #endif
+        }
+
+        // 記録していない実行があった場合は、そこからログを取り直す
+        void sync(unsigned long long count){
+            if(count == this->log_end) return;
+            this->log_begin = this->log_end = this->barrier_end = count;
+            #ifdef EXTENDED
+            this->irreversible_end = count; // その区間で送受信があったかどうかが分からない
+            #else
+            if(output_sink.is_open()) this->irreversible_end = count;
+            #endif
+        }
+        void take_checkpoint(){
+            if(this->checkpoints.size() == checkpoint_max){ // 1つおきに間引く
+                std::vector<std::unique_ptr<Snapshot>> kept;
+                for(unsigned int i=0; i<this->checkpoints.size(); ++i){
+                    if(i % 2 == 1){
+                        kept.push_back(std::move(this->checkpoints[i]));
+                    }else{
+                        this->pool.push_back(std::move(this->checkpoints[i]));
+                    }
+                }
+                this->checkpoints = std::move(kept);
+                this->interval *= 2;
+            }
+            std::unique_ptr<Snapshot> s;
+            if(this->pool.empty()){
+                s = std::make_unique<Snapshot>();
+            }else{
+                s = std::move(this->pool.back());
+                this->pool.pop_back();
+            }
+            s->capture();
+            this->checkpoints.push_back(std::move(s));
+            this->next_checkpoint = this->log_end + this->interval;
+        }
+        // 指定した命令数以前で最新のチェックポイントに戻り、それより後のチェックポイントは捨てる
+        bool restore_checkpoint(unsigned long long target){
+            std::size_t n = this->checkpoints.size();
+            while(n > 0 && this->checkpoints[n - 1]->op_count() > target) --n;
+            const Snapshot* s = n == 0 ? this->initial : this->checkpoints[n - 1].get();
+            if(s->op_count() < this->irreversible_end) return false; // そこからの再実行では送受信を再現できない
+            while(this->checkpoints.size() > n){
+                this->pool.push_back(std::move(this->checkpoints.back()));
+                this->checkpoints.pop_back();
+            }
+            s->restore();
+            this->log_begin = this->log_end = this->barrier_end = s->op_count();
+            this->next_checkpoint = s->op_count() + this->interval;
+            return true;
+        }
+        // ログを1命令分戻す
+        void revert_last(){
+            const Entry& e = this->log[(this->log_end - 1) % undo_log_size];
+            pc = e.pc;
+            if(e.is_fp){
+                reg_fp.write_32(e.rd, e.rd_old);
+            }else{
+                reg_int.write_32(e.rd, e.rd_old);
+            }
+            if(e.has_mem) memory.write(e.mem_addr, e.mem_old);
+            --op_type_count[static_cast<int>(e.type)];
+            --this->log_end;
+        }
+    public:
+        // 読み込み直後の状態を起点として記録を始める (init後にも呼ぶ)
+        void reset(Snapshot& initial, bool is_loggable){
+            this->initial = &initial;
+            this->is_loggable = is_loggable;
+            if(this->log.empty()) this->log.resize(undo_log_size);
+            while(!this->checkpoints.empty()){
+                this->pool.push_back(std::move(this->checkpoints.back()));
+                this->checkpoints.pop_back();
+            }
+            this->interval = checkpoint_interval;
+            this->log_begin = this->log_end = this->barrier_end = this->irreversible_end = initial.op_count();
+            this->next_checkpoint = this->log_end + this->interval;
+        }
+        void reset(){
+            this->reset(*this->initial, this->is_loggable);
+        }
+        // 1命令実行して記録する
+        int exec(){
+            this->sync(op_count());
+            const Operation& op = op_list[pc];
+            Entry& e = this->log[this->log_end % undo_log_size];
+            e.pc = pc;
+            e.type = op.type;
+            e.is_barrier = !this->is_loggable || op.type == Otype::o_lrd || op.type == Otype::o_std || op.type == Otype::o_si;
+            e.is_fp = op.use_rd_fp();
+            e.rd = (op.use_rd_int() || op.use_rd_fp()) ? op.rd : 0;
+            e.rd_old = e.is_fp ? reg_fp.read_32(e.rd) : reg_int.read_32(e.rd);
+            e.has_mem = false;
+            if(op.type == Otype::o_sw || op.type == Otype::o_fsw){
+                int addr = reg_int.read_int(op.rs1) + op.imm;
+                if(0 <= addr && static_cast<unsigned int>(addr) < memory.size()){ // 範囲外ならexec_opの側で例外になる
+                    e.has_mem = true;
+                    e.mem_addr = addr;
+                    e.mem_old = memory.read(addr);
+                }
+            }
+            bool is_irreversible = this->is_irreversible(op.type);
+            int res = exec_op();
+            ++this->log_end;
+            if(this->log_end - this->log_begin > undo_log_size) ++this->log_begin;
+            if(e.is_barrier) this->barrier_end = this->log_end;
+            if(is_irreversible) this->irreversible_end = this->log_end;
+            if(this->log_end >= this->next_checkpoint) this->take_checkpoint();
+            return res;
+        }
+        // 状態が外から書き換えられた場合 (set reg): それ以前のログは捨て、現在の状態をチェックポイントにする
+        void mark_modified(){
+            unsigned long long count = op_count();
+            this->sync(count);
+            while(!this->checkpoints.empty() && this->checkpoints.back()->op_count() >= count){
+                this->pool.push_back(std::move(this->checkpoints.back()));
+                this->checkpoints.pop_back();
+            }
+            this->log_begin = this->barrier_end = count;
+            this->take_checkpoint();
+        }
+        // 戻ることのできる最小の実行命令数
+        unsigned long long lower_bound() const {
+            return this->irreversible_end;
+        }
+        // 実行命令数がtargetの時点に戻る (失敗した場合はfalse)
+        bool undo_to(unsigned long long target){
+            unsigned long long count = op_count();
+            this->sync(count);
+            if(target > count || target < this->irreversible_end) return false;
+            if(target < this->log_begin || target < this->barrier_end){ // ログでは戻れないので、チェックポイントから再実行
+                if(!this->restore_checkpoint(target)) return false;
+                while(this->log_end < target) this->exec();
+            }else{
+                while(this->log_end > target) this->revert_last();
+            }
+            return true;
+        }
+        // 現在より前で、PCが条件を満たした最後の時点の実行命令数を探す (見つからなければstd::nullopt)
+        // ログに残っていない区間は、チェックポイントから再実行してログを作り直しながら遡る (見つからなければ元の時点まで再実行する)
+        template<class F> std::optional<unsigned long long> find_backward(F is_target){
+            unsigned long long count = op_count();
+            this->sync(count);
+            unsigned long long end = count; // [log_begin, end)の範囲を探す
+            while(true){
+                for(unsigned long long i=end; i>std::max(this->log_begin, this->irreversible_end); --i){
+                    if(is_target(this->log[(i - 1) % undo_log_size].pc)) return i - 1;
+                }
+                if(this->log_begin <= this->irreversible_end) break;
+                end = this->log_begin;
+                if(!this->restore_checkpoint(end - 1)) break;
+                while(this->log_end < end) this->exec();
+            }
+            while(this->log_end < count) this->exec();
+            return std::nullopt;
+        }
+};
+
+extern History history;
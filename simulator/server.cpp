@@ -12,16 +12,31 @@
 #include <regex>
 #include <unistd.h>
 #include <iomanip>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sys/epoll.h>
+#include <socket.hpp>
+#include <mapped_file.hpp>
+#include <string_view>
+#include <chrono>
 
 
 /* グローバル変数 */
-std::vector<Bit32> data_received; // 受け取ったデータのリスト
+std::map<int, std::unique_ptr<Session>> sessions; // セッションIDごとの受信データ
+std::mutex sessions_mutex; // sessionsへの追加・検索用 (受信データ自体はロックせずに読み書きする)
+std::atomic<int> latest_session{-1}; // 最後に作られたセッション
+int current_session = -1; // コマンドの対象として選択中のセッション (-1なら最後に作られたもの)
 std::string head = "\x1b[1m[server]\x1b[0m "; // ターミナルへの出力用
 // bool is_debug = false;
 
 // 通信関連
 int port = 20214; // 通信に使うポート番号
-struct sockaddr_in opponent_addr; // 通信相手(./sim)の情報
+bool is_unix_socket = false; // TCPの代わりにUnixドメインソケットを使うモード
+std::map<int, int> sim_sockets; // ./simへの送信用のソケット (ポート番号ごとに接続を維持して使い回す)
+int instance_num = 1; // 同時に通信するsim+の台数
 // int client_socket; // 送信用のソケット
 // bool is_connected = false; // 通信が維持されているかどうかのフラグ
 
@@ -34,7 +49,7 @@ int main(int argc, char *argv[]){
     // コマンドライン引数をパース
     int option;
     std::string filename;
-    while ((option = getopt(argc, argv, "p:")) != -1){
+    while ((option = getopt(argc, argv, "p:n:u")) != -1){
         switch(option){
             // case 'd':
             //     is_debug = true;
@@ -42,6 +57,12 @@ int main(int argc, char *argv[]){
             case 'p':
                 port = std::stoi(std::string(optarg));
                 break;
+            case 'n':
+                instance_num = std::stoi(std::string(optarg));
+                break;
+            case 'u':
+                is_unix_socket = true;
+                break;
             default:
                 std::cerr << head_error << "Invalid command-line argument" << std::endl;
                 std::exit(EXIT_FAILURE);
@@ -81,82 +102,41 @@ bool exec_command(std::string cmd){
         bool is_bin = match[2].str() == "-b";
         std::string filename = match[3].str();
         std::string input_filename = "./data/" + filename + (is_bin ? ".bin" : ".txt");
-        std::ifstream input_file;
-        if(is_bin){
-            input_file.open(input_filename, std::ios::in | std::ios::binary);
-        }else{
-            input_file.open(input_filename);
-        }
-        if(!input_file){
-            std::cerr << head_error << "could not open " << input_filename << std::endl;
-            std::exit(EXIT_FAILURE);
-        }else{
-            std::cout << head_info << "opened file: " << input_filename << std::endl;
-        }
+        Mapped_file input_file(input_filename);
+        std::cout << head_info << "opened file: " << input_filename << std::endl;
 
-        if(is_bin){ // バイナリファイルの場合の処理
-            int recv_count = 3;
-            unsigned char c;
-            int acc = 0;
-            while(!input_file.eof()){
-                input_file.read((char*) &c, sizeof(char)); // 8bit取り出す
-                acc += static_cast<int>(c) << (recv_count * 8);
-                --recv_count;
-                if(recv_count == -1){
-                    exec_command("send " + std::to_string(acc)); // todo: なぜか-1が末尾に追加されて送信されている
-                    acc = 0;
-                    recv_count = 3;
-                }
-            }
-        }else{ // テキストファイルの場合の処理
-            std::string line;
-            while(std::getline(input_file, line)){
-                if(std::regex_match(line, std::regex("^\\s*\\r?\\n?$"))){
-                    continue;
-                }else{
-                    std::stringstream ss{line};
-                    std::string buf;
-                    while(std::getline(ss, buf, ' ')){
-                        if(std::regex_match(buf, std::regex("(\\s|\\t)*\\r?\\n?"))){
-                            continue;
-                        }else{
-                            exec_command("send " + buf);
-                        }
+        if(is_bin){ // バイナリファイルの場合は中身をそのまま送る
+            send_bulk(input_file.data, input_file.size);
+        }else{ // テキストファイルの場合は空白区切りの値を4バイトずつ(big endianで)並べてから送る
+            std::vector<unsigned char> data;
+            std::string_view text(reinterpret_cast<const char*>(input_file.data), input_file.size);
+            std::size_t pos = 0;
+            while(pos < text.size()){
+                std::size_t end = text.find_first_of(" \t\r\n", pos);
+                if(end == std::string_view::npos) end = text.size();
+                if(end > pos){
+                    int v;
+                    if(!value_of_input(std::string(text.substr(pos, end - pos)), v)){
+                        std::cout << head_error << "invalid value in " << input_filename << ": " << text.substr(pos, end - pos) << std::endl;
+                        return false;
                     }
+                    for(int i=0; i<4; ++i) data.push_back(static_cast<unsigned char>(v >> (24 - i * 8)));
                 }
+                pos = end + 1;
             }
+            send_bulk(data.data(), data.size());
         }
     }else if(std::regex_match(cmd, match, std::regex("^\\s*(send)\\s+(.+)\\s*$"))){ // send N
         std::string input = match[2].str();
-        std::string data;
-        if(std::regex_match(input, std::regex("(-)?\\d+"))){
-            data = binary_of_int(std::stoi(input));
-        }else if(std::regex_match(input, std::regex("0f.+"))){
-            data = binary_of_float(std::stof(input.substr(2)));
-        }else if(std::regex_match(input, std::regex("0b(0|1)+"))){
-            data = data_of_binary(input.substr(2));
-        // }else if(std::regex_match(input, std::regex("0t.+"))){
-        //     data = "t" + input.substr(2);
-        // }else if(std::regex_match(input, std::regex("0n.+"))){
-        //     data = "n" + input.substr(2);
-        }else{
+        int v;
+        if(!value_of_input(input, v)){
             std::cout << head_error << "invalid argument for 'send'" << std::endl;
             return false;
         }
 
-        // データ送信の準備
-        struct in_addr host_addr;
-        inet_aton("127.0.0.1", &host_addr);
-        opponent_addr.sin_family = AF_INET;
-        opponent_addr.sin_port = htons(port);
-        opponent_addr.sin_addr = host_addr;
-
-        int client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if(connect(client_socket, (struct sockaddr *) &opponent_addr, sizeof(opponent_addr)) != 0){
-            std::cout << head_error << "connection failed (check whether ./sim has been started)" << std::endl;
-        }
-        
-        send(client_socket, data.c_str(), data.size(), 0);
+        unsigned char data[4]; // big endian
+        for(int i=0; i<4; ++i) data[i] = static_cast<unsigned char>(v >> (24 - i * 8));
+        send_to_sim(data, 4);
     // }else if(std::regex_match(cmd, match, std::regex("^\\s*(boot)\\s+([a-zA-Z_]+)\\s*$"))){ // boot filename
     //     std::string filename = match[2].str();
     //     std::string input_filename;
@@ -208,8 +188,22 @@ bool exec_command(std::string cmd){
     //     std::cout << head_info << "bootloading end" << std::endl;
     //     bootloading_start_flag = false;
     //     bootloading_end_flag = false;
+    }else if(std::regex_match(cmd, std::regex("^\\s*(sessions)\\s*$"))){ // sessions
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        if(sessions.empty()){
+            std::cout << "no session" << std::endl;
+        }
+        for(auto& [id, session] : sessions){
+            std::cout << (id == target_session() ? "* " : "  ");
+            std::cout << "session " << id << ": " << session->log.size() << " bytes received";
+            std::cout << (session->connection_num > 0 ? " (connected)" : "") << std::endl;
+        }
+    }else if(std::regex_match(cmd, match, std::regex("^\\s*(session)\\s+(\\d+)\\s*$"))){ // session N
+        current_session = std::stoi(match[2].str());
+        std::cout << head_info << "selected session " << current_session << std::endl;
     }else if(std::regex_match(cmd, match, std::regex("^\\s*(out)(\\s+(-p|-b))?(\\s+(-f)\\s+(\\w+))?\\s*$"))){ // out
-        if(!data_received.empty()){
+        Session* session = selected_session();
+        if(session != nullptr && session->log.size() > 0){
             bool is_ppm = match[3].str() == "-p";
             bool is_bin = match[3].str() == "-b";
             
@@ -244,18 +238,14 @@ bool exec_command(std::string cmd){
 
             // 出力
             std::stringstream output;
-            if(is_ppm){
-                for(auto b32 : data_received){
-                    output << (unsigned char) b32.i;
-                }
-            }else if(is_bin){
-                for(auto b32 : data_received){
-                    output.write((char*) &b32, sizeof(char)); // 8bitだけ書き込む
-                }
+            if(is_ppm || is_bin){
+                session->log.for_each([&](unsigned char c){
+                    output << c;
+                });
             }else{
-                for(auto b32 : data_received){
-                    output << b32.to_string(Stype::t_hex) << std::endl;
-                }
+                session->log.for_each([&](unsigned char c){
+                    output << Bit32(static_cast<int>(c)).to_string(Stype::t_hex) << std::endl;
+                });
             }
             output_file << output.str();
             std::cout << head_info << "data written in " << output_filename << std::endl;
@@ -263,9 +253,12 @@ bool exec_command(std::string cmd){
             std::cout << head_error << "data buffer is empty" << std::endl;
         }
     }else if(std::regex_match(cmd, std::regex("^\\s*(info)\\s*$"))){ // info
+        Session* session = selected_session();
         std::cout << "data list: \n  ";
-        for(auto b32 : data_received){
-            std::cout << b32.to_string(Stype::t_hex) << "; ";
+        if(session != nullptr){
+            session->log.for_each([](unsigned char c){
+                std::cout << Bit32(static_cast<int>(c)).to_string(Stype::t_hex) << "; ";
+            });
         }
         std::cout << std::endl;
     }else{
@@ -275,42 +268,241 @@ bool exec_command(std::string cmd){
     return res;
 }
 
+// sendの引数を値に変換 (通常の10進数なら整数, 0fから始まれば浮動小数点数, 0bから始まれば2進数として解釈)
+bool value_of_input(const std::string& input, int& v){
+    if(std::regex_match(input, std::regex("(-)?\\d+"))){
+        v = std::stoi(input);
+    }else if(std::regex_match(input, std::regex("0f.+"))){
+        v = Bit32(std::stof(input.substr(2))).i;
+    }else if(std::regex_match(input, std::regex("0b(0|1)+"))){
+        v = int_of_binary(data_of_binary(input.substr(2)));
+    // }else if(std::regex_match(input, std::regex("0t.+"))){
+    //     data = "t" + input.substr(2);
+    // }else if(std::regex_match(input, std::regex("0n.+"))){
+    //     data = "n" + input.substr(2);
+    }else{
+        return false;
+    }
+    return true;
+}
+
+// 大きなデータをbulk_chunk_sizeずつのフレームに分けて送り、進捗と転送速度を表示
+bool send_bulk(const unsigned char* data, std::size_t size){
+    auto start = std::chrono::steady_clock::now();
+    std::size_t sent = 0;
+    while(sent < size){
+        std::size_t n = std::min<std::size_t>(bulk_chunk_size, size - sent);
+        if(!send_to_sim(data + sent, n)) return false;
+        sent += n;
+        std::cout << "\r" << head << "sent " << sent << " / " << size << " bytes (" << sent * 100 / size << "%)" << std::flush;
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if(size > 0) std::cout << std::endl;
+    std::cout << head_info << "sent " << size << " bytes in " << sec << " s (" << (sec > 0 ? static_cast<double>(size) / sec / 1e6 : 0) << " MB/s)" << std::endl;
+    return true;
+}
+
+// 全体を送り切るまでsendを繰り返す
+bool send_all(int socket, const unsigned char* data, std::size_t size){
+    while(size > 0){
+        ssize_t res = send(socket, data, size, MSG_NOSIGNAL);
+        if(res <= 0) return false;
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+// ./simへの接続 (先頭でバイナリ形式であることを伝える)
+int connect_to_sim(int sim_port){
+    int sim_socket = connect_to(sim_port, is_unix_socket);
+    if(sim_socket >= 0 && !send_all(sim_socket, &protocol_raw_tag, 1)){
+        close(sim_socket);
+        return -1;
+    }
+    return sim_socket;
+}
+
+// ./simへのデータ送信 (長さ付きの1フレームとして、選択中のセッションのsim+に送る)
+bool send_to_sim(const unsigned char* data, std::size_t size){
+    int sim_port = target_session(); // セッションIDはsim+の受信用のポート番号
+    unsigned char frame_header[4];
+    for(int i=0; i<4; ++i) frame_header[i] = static_cast<unsigned char>(size >> (24 - i * 8));
+    for(int retry=0; retry<2; ++retry){ // 保持していた接続が切れていた場合は1度だけ繋ぎ直す
+        auto it = sim_sockets.find(sim_port);
+        if(it == sim_sockets.end()){
+            int sim_socket = connect_to_sim(sim_port);
+            if(sim_socket < 0) break;
+            it = sim_sockets.emplace(sim_port, sim_socket).first;
+        }
+        if(send_all(it->second, frame_header, 4) && send_all(it->second, data, size)) return true;
+        close(it->second);
+        sim_sockets.erase(it);
+    }
+    std::cout << head_error << "connection failed (check whether ./sim has been started)" << std::endl;
+    return false;
+}
+
+// セッションの取得 (is_creatingなら存在しない場合に作成)
+Session* find_session(int id, bool is_creating){
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    auto it = sessions.find(id);
+    if(it != sessions.end()) return it->second.get();
+    if(!is_creating) return nullptr;
+    latest_session = id;
+    return sessions.emplace(id, std::make_unique<Session>(id)).first->second.get();
+}
+
+// コマンドの対象となるセッションID (未選択なら最後に作られたもの、まだ1つもなければ1つ目のsim+)
+// send/info/outで対象を揃えるため、全てここで決める
+int target_session(){
+    if(current_session >= 0) return current_session;
+    int latest = latest_session.load();
+    return latest >= 0 ? latest : port;
+}
+
+// コマンドの対象となるセッション
+Session* selected_session(){
+    return find_session(target_session(), false);
+}
+
 // データの受信
+// 待ち受け用のソケットと全ての接続をepollでまとめて扱う
 void receive(){
-    // 受信設定
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port+1);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-
-    // 受信の準備
-    int server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    bind(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr));
-    listen(server_socket, 5);
-
-    // クライアントの情報を保持する変数など
-    struct sockaddr_in client_addr;
-    int client_socket;
-    int client_addr_size = sizeof(client_addr);
-    char buf[8];
-    int recv_len;
+    int epoll_fd = epoll_create1(0);
+    std::map<int, int> listen_sockets; // 待ち受け用のソケット -> 従来の形式で接続してきた場合のセッションID
+    for(int i=0; i<instance_num; ++i){ // i番目のsim+はport+2iで受信し、port+2i+1に送信してくる
+        int server_socket = listen_on(port + 2 * i + 1, is_unix_socket, 16);
+        if(server_socket < 0){
+            std::cerr << head_error << "could not listen on " << (is_unix_socket ? unix_socket_path(port + 2 * i + 1) : "port " + std::to_string(port + 2 * i + 1)) << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = server_socket;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev);
+        listen_sockets.emplace(server_socket, port + 2 * i);
+    }
+
+    std::map<int, Connection> connections;
+    std::vector<struct epoll_event> events(64);
+    std::vector<unsigned char> buf(receive_chunk_size);
+
+    // 接続を閉じる
+    auto close_connection = [&](std::map<int, Connection>::iterator it){
+        if(it->second.session != nullptr) --it->second.session->connection_num;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+        close(it->first);
+        connections.erase(it);
+    };
 
     while(true){
-        client_socket = accept(server_socket, (struct sockaddr *) &client_addr, (socklen_t *) &client_addr_size);
-        while((recv_len = recv(client_socket, buf, 8, 0)) != 0){
-            send(client_socket, "0", 1, 0); // 成功したらループバック
-
-            // 受信したデータの処理
-            std::string data(buf);
-            // Bit32 res = bit32_of_data(data);
-            // std::cout << head_data << "received " << bit32_of_data(data).to_string(Stype::t_hex) << std::endl;
-            // std::cout << "\033[2D# " << std::flush;
-            // if(res.i == 153) bootloading_start_flag = true; // ブートローダ用通信の開始
-            // if(res.i == 170) bootloading_end_flag = true; // ブートローダ用通信の終了
-            data_received.emplace_back(bit32_of_data(data));
+        // 挨拶を送るべき接続があれば、その時刻までに起きる
+        auto now = std::chrono::steady_clock::now();
+        int timeout = -1;
+        for(auto& [fd, conn] : connections){
+            if(conn.state != Connection::State::waiting) continue;
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(conn.accepted_at + std::chrono::milliseconds(protocol_greeting_delay) - now).count();
+            timeout = timeout < 0 ? std::max<int>(left, 0) : std::min<int>(timeout, std::max<int>(left, 0));
+        }
+
+        int n = epoll_wait(epoll_fd, events.data(), events.size(), timeout);
+        for(int i=0; i<n; ++i){
+            int fd = events[i].data.fd;
+            if(auto l = listen_sockets.find(fd); l != listen_sockets.end()){ // 新しい接続
+                int client_socket = accept_from(fd, is_unix_socket);
+                if(client_socket < 0) continue;
+                Connection conn;
+                conn.socket = client_socket;
+                conn.default_session = l->second;
+                conn.accepted_at = std::chrono::steady_clock::now();
+                connections.emplace(client_socket, conn);
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.fd = client_socket;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev);
+            }else if(auto it = connections.find(fd); it != connections.end()){
+                ssize_t recv_len = recv(fd, buf.data(), buf.size(), 0);
+                if(recv_len <= 0 || !handle_received(it->second, buf.data(), recv_len)){ // 切断された場合
+                    close_connection(it);
+                }
+            }
+        }
+
+        // 接続直後にクライアントから何も届かなければ挨拶を送り、バイナリ形式を提案する
+        // (従来のクライアントは接続してすぐに8文字のテキストを送ってくる)
+        now = std::chrono::steady_clock::now();
+        for(auto it = connections.begin(); it != connections.end();){
+            auto next = std::next(it);
+            Connection& conn = it->second;
+            if(conn.state == Connection::State::waiting && now - conn.accepted_at >= std::chrono::milliseconds(protocol_greeting_delay)){
+                unsigned char greeting[2] = {protocol_raw_tag, protocol_version};
+                if(send_all(conn.socket, greeting, 2)){
+                    conn.state = Connection::State::handshake;
+                }else{
+                    close_connection(it);
+                }
+            }
+            it = next;
         }
-        close(client_socket);
     }
 
     return;
 }
+
+// 受信したバイト列の処理 (通信を続けられなくなった場合はfalse)
+bool handle_received(Connection& conn, const unsigned char* buf, std::size_t size){
+    std::size_t i = 0;
+    while(i < size){
+        switch(conn.state){
+            case Connection::State::waiting: // 挨拶より先に届いた場合は従来の形式
+                conn.state = Connection::State::text;
+                conn.session = find_session(conn.default_session, true);
+                ++conn.session->connection_num;
+                break;
+            case Connection::State::handshake: // protocol_raw_tagに続いてセッションID(big endian 4バイト)
+                if(conn.handshake_len == 0 && buf[i] != protocol_raw_tag){ // 挨拶に応じなかった場合は従来の形式
+                    conn.state = Connection::State::waiting;
+                    break;
+                }
+                conn.handshake[conn.handshake_len++] = buf[i++];
+                if(conn.handshake_len == 5){
+                    int id = (conn.handshake[1] << 24) | (conn.handshake[2] << 16) | (conn.handshake[3] << 8) | conn.handshake[4];
+                    conn.session = find_session(id, true);
+                    ++conn.session->connection_num;
+                    conn.state = Connection::State::raw;
+                }
+                break;
+            case Connection::State::raw: // 4バイトの長さ(big endian)に続くバイト列を1フレームとし、フレームを受け取るたびに受信したバイト数の累計を返す
+                if(conn.remaining == 0){
+                    conn.frame_len = (conn.frame_len << 8) | buf[i++];
+                    if(++conn.header_len < 4) break;
+                    conn.remaining = conn.frame_len;
+                    conn.header_len = 0;
+                    conn.frame_len = 0;
+                }else{
+                    std::size_t n = std::min<std::size_t>(conn.remaining, size - i);
+                    conn.session->log.append(buf + i, n);
+                    conn.received += n;
+                    conn.remaining -= n;
+                    i += n;
+                }
+                if(conn.remaining == 0){ // フレームの終わり
+                    unsigned char ack[4];
+                    for(int j=0; j<4; ++j) ack[j] = static_cast<unsigned char>(conn.received >> (24 - j * 8));
+                    if(!send_all(conn.socket, ack, 4)) return false;
+                }
+                break;
+            case Connection::State::text: // 8文字ごとに1バイトとして扱い、"0"を返す
+                conn.text[conn.text_len++] = buf[i++];
+                if(conn.text_len == 8){
+                    unsigned char c = static_cast<unsigned char>(bit32_of_data(std::string(conn.text, 8)).i);
+                    conn.session->log.append(&c, 1);
+                    conn.text_len = 0;
+                    if(!send_all(conn.socket, reinterpret_cast<const unsigned char*>("0"), 1)) return false; // 成功したらループバック
+                }
+                break;
+        }
+    }
+    return true;
+}
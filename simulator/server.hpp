@@ -1,7 +1,108 @@
-#pragma once
-#include <string>
-
-/* プロトタイプ宣言 */
-void server(); // コマンド入力をもとにデータを送信
-bool exec_command(std::string cmd); // コマンドを読み、実行
-void receive(); // データの受信
+#pragma once
+#include <params.hpp>
+#include <string>
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+
+/* セッションごとの受信データ */
+// 受信スレッドだけが追記し、コマンド処理のスレッドは公開済みの範囲だけを読む (追記専用のlock-freeなログ)
+class Receive_log{
+    private:
+        static constexpr std::size_t segment_size = 65536;
+        struct Segment{
+            unsigned char data[segment_size];
+            Segment* next = nullptr;
+        };
+        Segment* head_segment; // 読み出しは先頭から辿る
+        Segment* tail_segment; // 追記側のみが触る
+        std::atomic<std::size_t> count{0}; // 公開済みのバイト数
+    public:
+        Receive_log(){
+            this->head_segment = this->tail_segment = new Segment;
+        }
+        Receive_log(const Receive_log&) = delete;
+        Receive_log& operator=(const Receive_log&) = delete;
+        ~Receive_log(){
+            while(this->head_segment != nullptr){
+                Segment* next = this->head_segment->next;
+                delete this->head_segment;
+                this->head_segment = next;
+            }
+        }
+        void append(const unsigned char* data, std::size_t size){
+            std::size_t c = this->count.load(std::memory_order_relaxed);
+            while(size > 0){
+                std::size_t offset = c % segment_size;
+                if(offset == 0 && c != 0){
+                    Segment* s = new Segment;
+                    this->tail_segment->next = s;
+                    this->tail_segment = s;
+                }
+                std::size_t n = std::min(size, segment_size - offset);
+                std::memcpy(this->tail_segment->data + offset, data, n);
+                c += n;
+                data += n;
+                size -= n;
+            }
+            this->count.store(c, std::memory_order_release);
+        }
+        std::size_t size() const {
+            return this->count.load(std::memory_order_acquire);
+        }
+        template<class F> void for_each(F f) const {
+            std::size_t n = this->size();
+            const Segment* s = this->head_segment;
+            for(std::size_t i=0; i<n; ++i){
+                if(i % segment_size == 0 && i != 0) s = s->next;
+                f(s->data[i % segment_size]);
+            }
+        }
+};
+
+/* セッション (通信相手のsim+ごと) */
+struct Session{
+    int id; // セッションID (sim+の受信用のポート番号)
+    Receive_log log;
+    std::atomic<int> connection_num{0}; // 現在の接続数
+    Session(int id) : id(id) {}
+};
+
+/* 受信側の接続ごとの状態 (受信スレッドのみが触る) */
+struct Connection{
+    enum class State{
+        waiting, // 接続直後 (クライアントから届くのを待ち、届かなければ挨拶を送る)
+        handshake, // 挨拶の返答 (protocol_raw_tagとセッションID) の受信中
+        raw, // バイナリ形式
+        text // 従来の8文字のテキスト形式
+    };
+    int socket;
+    int default_session; // 従来の形式で接続してきた場合のセッションID
+    State state = State::waiting;
+    std::chrono::steady_clock::time_point accepted_at;
+    Session* session = nullptr;
+    unsigned char handshake[5];
+    unsigned int handshake_len = 0;
+    unsigned int header_len = 0;
+    unsigned int frame_len = 0;
+    unsigned int remaining = 0; // 現在のフレームの残りのバイト数
+    unsigned int received = 0; // 受信したバイト数の累計 (受信確認として返す)
+    char text[8];
+    unsigned int text_len = 0;
+};
+
+/* プロトタイプ宣言 */
+void server(); // コマンド入力をもとにデータを送信
+bool exec_command(std::string cmd); // コマンドを読み、実行
+void receive(); // データの受信
+bool handle_received(Connection&, const unsigned char*, std::size_t); // 受信したバイト列の処理
+Session* find_session(int, bool); // セッションの取得 (必要なら作成)
+int target_session(); // コマンドの対象となるセッションID
+Session* selected_session(); // コマンドの対象となるセッション
+bool value_of_input(const std::string&, int&); // sendの引数を値に変換
+bool send_bulk(const unsigned char*, std::size_t); // 大きなデータを分けて送信
+bool send_all(int, const unsigned char*, std::size_t); // 全体を送り切るまでsendを繰り返す
+int connect_to_sim(int); // ./simへの接続
+bool send_to_sim(const unsigned char*, std::size_t); // ./simへのデータ送信
@@ -13,6 +13,16 @@
 #include <boost/program_options.hpp>
 #include <chrono>
 #include <exception>
+#include <array>
+#include <utility>
+#include <threaded.hpp>
+#include <block.hpp>
+#include <jit.hpp>
+#include <aot.hpp>
+#include <snapshot.hpp>
+#include <reverse.hpp>
+#include <profiler.hpp>
+#include <cache_analysis.hpp>
 #ifdef EXTENDED // EXTENDED: 1stシミュレータ拡張版(sim+)用のコード
 #include <transmission.hpp>
 #include <thread>
@@ -33,6 +43,12 @@ Cache cache; // キャッシュ
 Gshare branch_predictor(gshare_width); // 分岐予測器
 TransmissionQueue receive_buffer; // 外部通信での受信バッファ
 TransmissionQueue send_buffer; // 外部通信での送信バッファ
+Output_sink output_sink; // stdの出力先 (開かれていなければ送信バッファに積む)
+Snapshot initial_state; // 読み込み直後の状態 (initで書き戻す)
+History history; // 逆実行のための記録 (デバッグモードのみ)
+Sampling_profiler sampling_profiler; // サンプリングによるプロファイラ
+Call_graph_profiler call_graph; // 関数ごとの実行命令数 (統計モードのみ)
+Cache_analyzer cache_analyzer; // キャッシュの構成の一括解析 (sim+の--cache-analysisのみ)
 
 unsigned int pc = 0; // プログラムカウンタ
 unsigned int code_size = 0; // コードサイズ
@@ -40,8 +56,13 @@ int mem_size = 100; // メモリサイズ
 
 unsigned int index_width_ = index_width;
 unsigned int offset_width_ = offset_width;
+unsigned int way_num_ = cache_way_num;
+Replacement replacement_ = Replacement::lru;
+bool is_write_back_ = true;
+bool is_write_allocate_ = true;
 
 int port = 20214; // 通信に使うポート番号
+bool is_unix_socket = false; // TCPの代わりにUnixドメインソケットを使うモード
 
 
 // シミュレーションの制御
@@ -51,20 +72,26 @@ bool is_info_output = false; // 出力モード
 bool is_bin = false; // バイナリファイルモード
 bool is_stat = false; // 統計モード
 bool is_cache_enabled = false; // キャッシュを考慮するモード
+bool is_cache_analysis = false; // 全てのキャッシュの構成のヒット率を一括で求めるモード
 bool is_gshare_enabled = false; // 分岐予測を組み込むモード
 bool is_skip = false; // ブートローディングの過程をスキップするモード
 // bool is_bootloading = false; // ブートローダ対応モード
 bool is_raytracing = false; // レイトレ専用モード
 bool is_ieee = false; // IEEE754に従って浮動小数演算を行うモード
 bool is_cautious = false; // 例外処理などを慎重に行うモード
+bool is_aot = false; // ネイティブのバイナリに変換するモード
+bool is_image = false; // 変換済みのイメージ(.simimg)を読み込むモード
+bool is_making_image = false; // イメージ(.simimg)に変換するモード
+Etype engine = Etype::e_switch; // 実行エンジン
 std::string filename; // 処理対象のファイル名
 bool is_preloading = false; // バッファのデータを予め取得しておくモード
 std::string preload_filename; // プリロード対象のファイル名
+std::string sink_filename; // stdの出力を直接書き出すファイル名
 
 // 統計・出力関連
 unsigned long long op_type_count[op_type_num]; // 各命令の実行数
 int input_line_num = 0; // ファイルの行数
-unsigned int *line_exec_count; // 行ごとの実行回数
+unsigned long long *pc_exec_count; // 命令(PC)ごとの実行回数 (行ごとの集計は出力時に行う)
 int max_x2 = 0;
 int memory_used = 0;
 unsigned long long *mem_accessed_read; // メモリのreadによるアクセス回数
@@ -75,6 +102,10 @@ unsigned long long heap_accessed_read_count = 0; // ヒープのreadによるア
 unsigned long long heap_accessed_write_count = 0; // ヒープのwriteによるアクセスの総回数
 double exec_time; // 実行時間
 double op_per_sec; // 秒あたりの実行命令数
+#ifdef EXTENDED
+double io_cpu_time_receive = 0; // 受信スレッドが使用したCPU時間
+double io_cpu_time_send = 0; // 送信スレッドが使用したCPU時間
+#endif
 std::string timestamp;
 
 // 処理用のデータ構造
@@ -95,6 +126,34 @@ bool is_waiting_for_lnum = false; // ライン数の受信を待っている途
 bool is_loading_codes = false; // 命令ロード中のフラグ
 int loading_id = 100; // 読み込んでいる命令のid
 
+// 機能ごとに特殊化した関数の表 (起動時に一度だけfeature_maskを決める)
+unsigned int feature_mask = 0;
+template<unsigned int... M>
+constexpr auto make_exec_op_table(std::integer_sequence<unsigned int, M...>){
+    return std::array<int (*)(), sizeof...(M)>{ &exec_op<M>... };
+}
+template<unsigned int... M>
+constexpr auto make_run_table(std::integer_sequence<unsigned int, M...>){
+    return std::array<int (*)(), sizeof...(M)>{ &run_until_end<M>... };
+}
+template<unsigned int... M>
+constexpr auto make_run_sampling_table(std::integer_sequence<unsigned int, M...>){
+    return std::array<int (*)(), sizeof...(M)>{ &run_sampling<M>... };
+}
+template<unsigned int... M>
+constexpr auto make_read_memory_table(std::integer_sequence<unsigned int, M...>){
+    return std::array<Bit32 (*)(int), sizeof...(M)>{ &read_memory<M>... };
+}
+template<unsigned int... M>
+constexpr auto make_write_memory_table(std::integer_sequence<unsigned int, M...>){
+    return std::array<void (*)(int, const Bit32&), sizeof...(M)>{ &write_memory<M>... };
+}
+constexpr auto exec_op_table = make_exec_op_table(std::make_integer_sequence<unsigned int, feature_num>());
+constexpr auto run_table = make_run_table(std::make_integer_sequence<unsigned int, feature_num>());
+constexpr auto run_sampling_table = make_run_sampling_table(std::make_integer_sequence<unsigned int, feature_num>());
+constexpr auto read_memory_table = make_read_memory_table(std::make_integer_sequence<unsigned int, feature_num>());
+constexpr auto write_memory_table = make_write_memory_table(std::make_integer_sequence<unsigned int, feature_num>());
+
 // ターミナルへの出力用
 #ifdef EXTENDED
 std::string head = "\x1b[1m[sim+]\x1b[0m ";
@@ -116,10 +175,25 @@ int main(int argc, char *argv[]){
         ("skip,s", "skipping bootloading")
         ("preload", po::value<std::string>()->implicit_value("contest"), "data preload")
         ("raytracing,r", "specialized for ray-tracing program")
+        ("engine", po::value<std::string>(), "execution engine (switch/threaded/block/jit)")
+        ("aot", "translate into a native binary")
+        ("image", "load a precompiled image (.simimg)")
+        ("make-image", "convert into a precompiled image (.simimg)")
+        ("sample", po::value<unsigned long long>()->implicit_value(sample_interval), "sampling profiler (every N operations)")
+        ("sample-timer", po::value<unsigned long long>()->implicit_value(sample_timer_interval), "sampling profiler (every N us of CPU time)")
+        ("sample-stack", "record call stacks in the sampling profiler")
+        #ifndef EXTENDED
+        ("output,o", po::value<std::string>(), "stream the output of std into the file during execution (- for stdout)")
+        #endif
         #ifdef EXTENDED
         ("port,p", po::value<int>(), "port number")
+        ("unix", "use Unix domain sockets instead of TCP (with ./server -u)")
         // ("boot", "bootloading mode")
-        ("cache,c", po::value<std::vector<unsigned int>>()->multitoken(), "cache setting")
+        ("cache,c", po::value<std::vector<unsigned int>>()->multitoken(), "cache setting (index width, offset width and optionally the number of ways)")
+        ("replacement", po::value<std::string>(), "cache replacement policy (lru/fifo/random)")
+        ("write-through", "write-through cache (write-back by default)")
+        ("no-write-allocate", "do not allocate a block on a write miss")
+        ("cache-analysis", "hit rates of all cache configurations in a single run")
         ("gshare,g", "branch prediction (Gshare)")
         ("stat", "statistics mode")
         ("cautious", "cautious mode")
@@ -156,17 +230,52 @@ int main(int argc, char *argv[]){
         preload_filename = vm["preload"].as<std::string>();
     };
     if(vm.count("raytracing")) is_raytracing = true;
+    if(vm.count("aot")) is_aot = true;
+    if(vm.count("image")) is_image = true;
+    if(vm.count("make-image")) is_making_image = true;
+    if(vm.count("output")) sink_filename = vm["output"].as<std::string>();
+    if(vm.count("engine")){
+        std::string engine_name = vm["engine"].as<std::string>();
+        if(engine_name == "switch"){
+            engine = Etype::e_switch;
+        }else if(engine_name == "threaded"){
+            engine = Etype::e_threaded;
+        }else if(engine_name == "block"){
+            engine = Etype::e_block;
+        }else if(engine_name == "jit"){
+            engine = Etype::e_jit;
+        }else{
+            std::cout << head_error << "invalid argument for --engine option (switch/threaded/block/jit)" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    if(vm.count("sample") || vm.count("sample-timer") || vm.count("sample-stack")){
+        sampling_profiler.is_enabled = true;
+        if(vm.count("sample-timer")){
+            sampling_profiler.is_timer = true;
+            sampling_profiler.interval = vm["sample-timer"].as<unsigned long long>();
+        }else if(vm.count("sample")){
+            sampling_profiler.interval = vm["sample"].as<unsigned long long>();
+        }
+        if(sampling_profiler.interval == 0){
+            std::cout << head_error << "invalid argument for --sample option" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        if(vm.count("sample-stack")) sampling_profiler.is_stack = true;
+    }
     #ifdef EXTENDED
     if(vm.count("port")) port = vm["port"].as<int>();
+    if(vm.count("unix")) is_unix_socket = true;
     // if(vm.count("boot")) is_bootloading = true;
     if(vm.count("cache")){
         is_cache_enabled = true;
         bool is_bad_arg = true;
         std::vector<unsigned int> cache_setting = vm["cache"].as<std::vector<unsigned int>>();
-        if(cache_setting.size() == 2){
+        if(cache_setting.size() == 2 || cache_setting.size() == 3){
             index_width_ = cache_setting[0];
             offset_width_ = cache_setting[1];
-            if(index_width_ + offset_width_ >= 32){
+            if(cache_setting.size() == 3) way_num_ = cache_setting[2];
+            if(index_width_ + offset_width_ >= 32 || way_num_ == 0){
                 std::cout << head_error << "invalid cache setting" << std::endl;
                 std::exit(EXIT_FAILURE);
             }else{
@@ -177,10 +286,29 @@ int main(int argc, char *argv[]){
             if(cache_setting[0] == 0) is_bad_arg = false;
         }
         if(is_bad_arg){
-            std::cout << head_error << "invalid argument(s) for -c option (there should be 2 ones)" << std::endl;
+            std::cout << head_error << "invalid argument(s) for -c option (there should be 2 or 3 ones)" << std::endl;
             std::exit(EXIT_FAILURE);
         }
     }
+    if(vm.count("replacement")){
+        std::string r = vm["replacement"].as<std::string>();
+        if(r == "lru"){
+            replacement_ = Replacement::lru;
+        }else if(r == "fifo"){
+            replacement_ = Replacement::fifo;
+        }else if(r == "random"){
+            replacement_ = Replacement::random;
+        }else{
+            std::cout << head_error << "invalid argument for --replacement option (lru/fifo/random)" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    if(vm.count("write-through")) is_write_back_ = false;
+    if(vm.count("no-write-allocate")) is_write_allocate_ = false;
+    if(vm.count("cache-analysis")){
+        is_cache_enabled = true;
+        is_cache_analysis = true;
+    }
     if(vm.count("gshare")) is_gshare_enabled = true;
     if(vm.count("cautious")) is_cautious = true;
     if(vm.count("stat")){
@@ -188,6 +316,14 @@ int main(int argc, char *argv[]){
     }
     #endif
 
+    // 有効な機能に応じて特殊化された関数を選ぶ
+    if(is_ieee) feature_mask |= f_ieee;
+    if(is_stat) feature_mask |= f_stat;
+    if(is_cache_enabled) feature_mask |= f_cache;
+    if(is_cautious) feature_mask |= f_cautious;
+    if(is_raytracing && (is_stat || is_cautious)) feature_mask |= f_raytracing;
+    if(is_gshare_enabled) feature_mask |= f_gshare;
+
     // タイムスタンプの取得
     time_t t = time(nullptr);
     tm* time = localtime(&t);
@@ -228,7 +364,8 @@ int main(int argc, char *argv[]){
     memory = Memory(mem_size);
 
     // キャッシュの初期化
-    cache = Cache(index_width_, offset_width_);
+    cache = Cache(index_width_, offset_width_, way_num_, replacement_, is_write_back_, is_write_allocate_);
+    if(is_cache_analysis) cache_analyzer.init();
 
     // 統計データの初期化
     if(is_stat){
@@ -239,16 +376,7 @@ int main(int argc, char *argv[]){
     // バッファのデータのプリロード
     if(is_preloading){
         preload_filename = "./data/" + preload_filename + ".bin";
-        std::ifstream preload_file(preload_filename, std::ios::in | std::ios::binary);
-        if(!preload_file){
-            std::cerr << head_error << "could not open " << preload_filename << std::endl;
-            std::exit(EXIT_FAILURE);
-        }
-        unsigned char c;
-        while(!preload_file.eof()){
-            preload_file.read((char*) &c, sizeof(char)); // 8bit取り出す
-            receive_buffer.push(Bit32(static_cast<int>(c)));
-        }
+        preload_data(preload_filename, receive_buffer);
         std::cout << head << "preloaded data to the receive-buffer from " + preload_filename << std::endl;
     }
 
@@ -257,90 +385,53 @@ int main(int argc, char *argv[]){
     // if(is_bootloading){
     //     input_filename = "./code/bootloader";
     // }else{
-        input_filename = "./code/" + filename + (is_bin ? ".bin" : (is_debug ? ".dbg" : ""));
+        input_filename = "./code/" + filename + (is_image ? ".simimg" : (is_bin ? ".bin" : (is_debug ? ".dbg" : "")));
     // }
-    std::ifstream input_file(input_filename);
-    if(!input_file.is_open()){
-        std::cerr << head_error << "could not open " << input_filename << std::endl;
-        std::exit(EXIT_FAILURE);
+    unsigned int code_id;
+    if(is_image){ // デコード済みの命令列などをそのまま読み込む (プリロードを指定していなければ含まれるデータを使う)
+        code_id = load_image(input_filename, input_line_num, is_preloading ? nullptr : &receive_buffer);
+    }else{ // ファイルの各行をパースしてop_listに追加
+        code_id = load_code(input_filename, is_bin, is_skip ? 100 : 0, input_line_num);
     }
 
-    // ファイルの各行をパースしてop_listに追加
-    std::string code;
-    std::string code_keep; // 空白でない最後の行を保存
-    int code_id = is_skip ? 100 : 0;
-    if(!is_bin){
-        std::regex regex_empty = std::regex("^\\s*\\r?\\n?$");
-        std::regex regex_dbg = std::regex("^\\d{32}@(-?\\d+)$");
-        std::regex regex_dbg_label = std::regex("^\\d{32}@(-?\\d+)#(([a-zA-Z_]\\w*(.\\d+)*))$");
-        std::regex regex_dbg_bp = std::regex("^\\d{32}@(-?\\d+)!(([a-zA-Z_]\\w*(.\\d+)*))$");
-        std::regex regex_dbg_label_bp = std::regex("^\\d{32}@(-?\\d+)#(([a-zA-Z_]\\w*(.\\d+)*))!(([a-zA-Z_]\\w*(.\\d+)*))$");
-        std::smatch match;
-        while(std::getline(input_file, code)){
-            if(std::regex_match(code, regex_empty)){ // 空行は無視
-                continue;
-            }else{
-                op_list.emplace_back(Operation(code));
-                
-                // ラベル・ブレークポイントの処理
-                if(code.size() > 32){
-                    if(is_debug){ // デバッグモード
-                        if(std::regex_match(code, match, regex_dbg)){
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                        }else if(std::regex_match(code, match, regex_dbg_label)){ // ラベルのみ
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                            label_to_id.insert(bimap_value_t(match[2].str(), code_id));             
-                        }else if(std::regex_match(code, match, regex_dbg_bp)){ // ブレークポイントのみ
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                            bp_to_id.insert(bimap_value_t(match[2].str(), code_id));
-                        }else if(std::regex_match(code, match, regex_dbg_label_bp)){ // ラベルとブレークポイントの両方
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                            label_to_id.insert(bimap_value_t(match[2].str(), code_id));
-                            bp_to_id.insert(bimap_value_t(match[3].str(), code_id));
-                        }else{
-                            std::cerr << head_error << "could not parse the code" << std::endl;
-                            std::exit(EXIT_FAILURE);
-                        }
-                    }else{ // デバッグモードでないのにラベルやブレークポイントの情報が入っている場合エラー
-                        std::cerr << head_error << "could not parse the code (maybe it is encoded in debug-style)" << std::endl;
-                        std::exit(EXIT_FAILURE);
-                    }
-                }
+    code_size = code_id;
 
-                ++code_id;
-                code_keep = code;
-            }
-        }
-        if(is_debug){
-            if(std::regex_match(code_keep, match, std::regex("^\\d{32}@(-?\\d+).*$"))){
-                input_line_num = std::stoi(match[1].str());
-            }
-        }
-    }else{
-        int read_state = 0;
-        unsigned char c;
-        int acc = 0;
-        while(!input_file.eof()){
-            input_file.read((char*) &c, sizeof(char)); // 8bit取り出す
-            acc += static_cast<int>(c) << ((3 - read_state) * 8);
-            ++read_state;
-            if(read_state == 4){
-                op_list.emplace_back(Operation(acc));
-                acc = 0;
-                read_state = 0;
-                ++code_id;
-            }
-        }
+    // イメージへの変換
+    if(is_making_image){
+        std::string image_filename = "./code/" + filename + ".simimg";
+        write_image(image_filename, code_size, input_line_num, is_preloading ? preload_filename : "");
+        std::cout << head << "converted into " << image_filename << std::endl;
+        std::exit(EXIT_SUCCESS);
     }
 
-    code_size = code_id;
-
-    if(is_stat) line_exec_count = (unsigned int*) calloc(input_line_num, sizeof(unsigned int));
+    if(is_stat){
+        pc_exec_count = (unsigned long long*) calloc(op_list.size(), sizeof(unsigned long long));
+        call_graph.reset(pc, 0);
+    }
+    if(sampling_profiler.is_enabled) sampling_profiler.reset();
 
     auto end = std::chrono::system_clock::now();
     auto msec = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
     std::cout << head << "time elapsed (preparation): " << msec << std::endl;
 
+    // ネイティブのバイナリへの変換 (siを含む場合はそのままインタプリタで実行)
+    if(is_aot && translate_aot()) std::exit(EXIT_SUCCESS);
+    #ifndef EXTENDED
+    // stdの出力先を開く (デバッグなしモードのレイトレでは、画像を実行中に直接書き出す)
+    if(!sink_filename.empty() || (is_raytracing && !is_debug)){
+        std::string sink_path = sink_filename.empty() ? "./out/output_" + timestamp + ".ppm" : sink_filename;
+        if(!output_sink.open(sink_path, is_raytracing || sink_path.ends_with(".ppm"))){
+            std::cerr << head_error << "could not open " << sink_path << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::cout << head << "streaming the output to " << sink_path << std::endl;
+    }
+    #endif
+
+    // 初期状態を保存
+    initial_state.capture();
+    if(is_debug) history.reset(initial_state, (feature_mask & (f_cache | f_gshare | f_stat)) == 0);
+
     #ifdef EXTENDED
     // コマンドの受け付けとデータ受信処理を別々のスレッドで起動
     std::thread t1(simulate);
@@ -348,31 +439,39 @@ int main(int argc, char *argv[]){
     Cancel_flag flg;
     std::thread t3(send_data, std::ref(flg));
     t1.join();
+    clockid_t receive_clock;
+    pthread_getcpuclockid(t2.native_handle(), &receive_clock);
+    io_cpu_time_receive = cpu_time_of(receive_clock);
     t2.detach();
     flg.signal();
+    send_buffer.notify();
     t3.join();
+    std::cout << head << "host CPU time used by I/O threads (s): receive " << io_cpu_time_receive << ", send " << io_cpu_time_send << std::endl;
     #else
     simulate();
     #endif
 
     // 実行結果の情報を出力
     if(is_info_output || is_stat) output_info();
+    if(is_cache_analysis) cache_analyzer.report("./info/" + filename + "_cache_" + timestamp + ".csv", offset_width_);
+    if(sampling_profiler.is_enabled) sampling_profiler.report("./info/" + filename + "_" + timestamp, sample_report_top);
     
-    // レイトレの場合は画像も出力
-    if(is_raytracing && sim_state == sim_state_end){
+    // stdの出力を閉じる (直接書き出していないレイトレの場合は、ここで送信バッファの内容を画像として出力)
+    if(output_sink.is_open()){
+        output_sink.close();
+        output_sink.report(head);
+    }else if(is_raytracing && sim_state == sim_state_end){
         if(!send_buffer.empty()){
             std::string output_filename = "./out/output_" + timestamp + ".ppm";
-            std::ofstream output_file(output_filename);
-            if(!output_file){
+            if(!output_sink.open(output_filename, true)){
                 std::cerr << head_error << "could not open " << output_filename << std::endl;
                 std::exit(EXIT_FAILURE);
             }
-            std::stringstream output;
             while(!send_buffer.empty()){
-                output << (unsigned char) send_buffer.pop().i;
+                output_sink.put(static_cast<unsigned char>(send_buffer.pop().i));
             }
-            output_file << output.str();
-            std::cout << head << "output image written in " << output_filename << std::endl;
+            output_sink.close();
+            output_sink.report(head);
         }else{
             std::cout << head_error << "send-buffer is empty" << std::endl;
         }
@@ -400,7 +499,6 @@ void simulate(){
 
 // デバッグモードのコマンドを認識して実行
 bool is_in_step = false; // step実行の途中
-bool is_in_undo = false; // undoの途中
 bool exec_command(std::string cmd){
     bool res = false; // デバッグモード終了ならtrue
     std::smatch match;
@@ -414,7 +512,7 @@ bool exec_command(std::string cmd){
     }else if(std::regex_match(cmd, std::regex("^\\s*(d|(do))\\s*$"))){ // do
         if(sim_state != sim_state_end){
             std::cout << "pc " << pc << " (line " << id_to_line.left.at(pc) << ") " << op_list[pc].to_string() << std::endl;
-            if((sim_state = exec_op()) == sim_state_end){
+            if((sim_state = history.exec()) == sim_state_end){
                 std::cout << head_info << "all operations have been simulated successfully!" << std::endl;
             }
         }else{
@@ -424,7 +522,7 @@ bool exec_command(std::string cmd){
         unsigned int n = std::stoi(match[3].str());
         if(sim_state != sim_state_end){
             for(unsigned int i=0; i<n; ++i){
-                if((sim_state = exec_op()) == sim_state_end){
+                if((sim_state = history.exec()) == sim_state_end){
                     std::cout << head_info << "all operations have been simulated successfully!" << std::endl;
                     break;
                 }
@@ -436,7 +534,7 @@ bool exec_command(std::string cmd){
         unsigned int n = std::stoi(match[3].str());
         if(sim_state != sim_state_end){
             while(op_count() < n){
-                if((sim_state = exec_op()) == sim_state_end){
+                if((sim_state = history.exec()) == sim_state_end){
                     std::cout << head_info << "all operations have been simulated successfully!" << std::endl;
                     break;
                 }
@@ -469,7 +567,17 @@ bool exec_command(std::string cmd){
         auto start = std::chrono::system_clock::now();
 
         // Endになるまで実行
-        while((sim_state = exec_op()) != sim_state_end);
+        if(sampling_profiler.is_enabled){ // プロファイラを使う場合は1命令ずつ実行
+            sim_state = run_sampling_table[feature_mask]();
+        }else if(engine == Etype::e_threaded && !is_stat && !is_cautious){ // 統計・cautiousモードでは1命令ずつの実行にフォールバック
+            sim_state = exec_threaded();
+        }else if(engine == Etype::e_block && !is_stat && !is_cautious){
+            sim_state = exec_block();
+        }else if(engine == Etype::e_jit && !is_stat && !is_cautious && !is_cache_enabled){ // JITではメモリアクセスがread_memory/write_memoryを通らない
+            sim_state = exec_jit();
+        }else{
+            sim_state = run_table[feature_mask]();
+        }
         auto end = std::chrono::system_clock::now();
         std::cout << head_info << "all operations have been simulated successfully!" << std::endl;
 
@@ -481,49 +589,52 @@ bool exec_command(std::string cmd){
             std::cout << head << "operation count: " << cnt << std::endl;
             op_per_sec = static_cast<double>(cnt) / exec_time;
             std::cout << head << "operations per second: " << op_per_sec << std::endl;
+            if(is_cache_enabled) std::cout << head << "estimated execution time (1 clock per operation + cache stalls): " << estimated_time() << std::endl;
         }
         // メモリ使用量を保存しておく
         if(is_raytracing){
             memory_used = reg_int.read_int(3);
         }
     }else if(std::regex_match(cmd, match, std::regex("^\\s*(un|(undo))\\s+(\\d+)\\s*$"))){ // undo N
-        unsigned int n = std::stoi(match[3].str());
+        unsigned long long n = std::stoull(match[3].str());
         unsigned long long cnt = op_count();
-        if(n <= cnt){
-            is_in_undo = true;
-            exec_command("init");
-            exec_command("do " + std::to_string(cnt - n));
-            is_in_undo = false;
-        }else{
+        if(n > cnt){
             std::cout << head_error << "invalid argument (too much undo)" << std::endl;
+        }else if(!history.undo_to(cnt - n)){
+            std::cout << head_error << "cannot undo beyond " << history.lower_bound() << " operations (data has already been sent or received)" << std::endl;
+        }else{
+            sim_state = sim_state_continue;
+            simulation_end = false;
+        }
+    }else if(std::regex_match(cmd, match, std::regex("^\\s*(rc|(reverse-continue))(\\s+(([a-zA-Z_]\\w*(.\\d+)*)))?\\s*$"))){ // reverse-continue (break)
+        std::string bp = match[4].str();
+        if(bp != "" && bp_to_id.left.find(bp) == bp_to_id.left.end()){
+            std::cout << head_error << "breakpoint '" << bp << "' has not been set" << std::endl;
+        }else{
+            auto found = history.find_backward([&bp](unsigned int p){
+                return bp == "" ? bp_to_id.right.find(p) != bp_to_id.right.end() : bp_to_id.left.at(bp) == p;
+            });
+            if(found){
+                history.undo_to(*found);
+                std::cout << head_info << "halt before breakpoint '" << bp_to_id.right.at(pc) << "' (pc " << pc << ", line " << id_to_line.left.at(pc) << ", " << op_count() << " operations executed)" << std::endl;
+            }else{
+                history.undo_to(history.lower_bound()); // 遡れるところまで戻る
+                std::cout << head_info << "breakpoint not encountered (reached " << op_count() << " operations executed)" << std::endl;
+            }
+            sim_state = sim_state_continue;
+            simulation_end = false;
         }
     }else if(std::regex_match(cmd, std::regex("^\\s*(i|(init))\\s*$"))){ // init
         sim_state = sim_state_continue;
         simulation_end = false;
-        pc = is_skip ? 100 : 0;
-        for(unsigned int i=0; i<op_type_num; ++i) op_type_count[i] = 0;
-        reg_int = Reg();
-        reg_fp = Reg();
-        memory = Memory(mem_size);
-        cache = Cache(index_width_, offset_width_);
-        branch_predictor = Gshare(gshare_width);
-        TransmissionQueue receive_buffer = TransmissionQueue();
-        TransmissionQueue send_buffer = TransmissionQueue();
-        // preload
-        if(is_preloading){
-            std::ifstream preload_file(preload_filename, std::ios::in | std::ios::binary);
-            if(!preload_file){
-                std::cerr << head_error << "could not open " << preload_filename << std::endl;
-                std::exit(EXIT_FAILURE);
-            }
-            unsigned char c;
-            while(!preload_file.eof()){
-                preload_file.read((char*) &c, sizeof(char)); // 8bit取り出す
-                receive_buffer.push(Bit32(static_cast<int>(c)));
-            }
-        }
-
-        if(!is_in_undo) std::cout << head_info << "simulation environment is now initialized" << std::endl;
+        initial_state.restore(); // 実行命令数・PC・レジスタ・メモリ・キャッシュ・分岐予測器・命令列・送受信バッファ
+        history.reset();
+        output_sink.restart();
+        if(sampling_profiler.is_enabled) sampling_profiler.reset();
+        if(is_stat) call_graph.reset(pc, op_count());
+        if(is_cache_analysis) cache_analyzer.reset();
+
+        std::cout << head_info << "simulation environment is now initialized" << std::endl;
     }else if(std::regex_match(cmd, std::regex("^\\s*(ir|(init run))\\s*$"))){ // init run
         exec_command("init");
         exec_command("run");
@@ -587,6 +698,11 @@ bool exec_command(std::string cmd){
                 std::cout << "  " << x.first << " (pc " << x.second << ", line " << id_to_line.left.at(x.second) << ")" << std::endl;
             }
         }
+        if(is_cache_enabled){
+            std::cout << "cache stat:" << std::endl;
+            std::cout << "  hit rate: " << static_cast<double>(cache.hit_times) / cache.accessed_times << std::endl;
+            std::cout << "  stall cycles: " << cache.stall_cycles << std::endl;
+        }
         if(is_gshare_enabled){
             std::cout << "prediction stat:" << std::endl;
             std::cout << "  taken rate: " << static_cast<double>(branch_predictor.taken_count) / branch_predictor.total_count << std::endl;
@@ -611,7 +727,9 @@ bool exec_command(std::string cmd){
                 receive_buffer.print(size);
             }
         }else if(match[3].str() == "sbuf"){
-            if(send_buffer.empty()){
+            if(output_sink.is_open()){
+                std::cout << "send buffer: (streamed to " << output_sink.name() << ", " << output_sink.size() << " bytes)" << std::endl;
+            }else if(send_buffer.empty()){
                 std::cout << "send buffer: (empty)" << std::endl;
             }else{
                 std::cout << "send buffer:\n  ";
@@ -650,6 +768,7 @@ bool exec_command(std::string cmd){
         int val = std::stoi(match[5].str());
         if(0 < reg_no && reg_no < 31){
             reg_int.write_int(reg_no, val);
+            history.mark_modified(); // これより前に戻ると書き換えも取り消される
         }else{
             std::cout << head_error << "invalid argument (integer registers are x0,...,x31)" << std::endl;
         }
@@ -722,7 +841,9 @@ bool exec_command(std::string cmd){
             std::cout << head_error << "breakpoint '" << bp_id << "' has not been set" << std::endl;  
         }
     }else if(std::regex_match(cmd, match, std::regex("^\\s*(out)(\\s+(-p|-b))?(\\s+(-f)\\s+(\\w+))?\\s*$"))){ // out (option)
-        if(!send_buffer.empty()){
+        if(output_sink.is_open()){
+            std::cout << head_info << "send-buffer data is streamed to " << output_sink.name() << std::endl;
+        }else if(!send_buffer.empty()){
             bool is_ppm = match[3].str() == "-p";
             bool is_bin = match[3].str() == "-b";
             
@@ -776,17 +897,14 @@ bool exec_command(std::string cmd){
     return res;
 }
 
-// 命令を実行し、PCを変化させる
+// 命令を実行し、PCを変化させる (Mは有効な機能を表すビット列)
+template<unsigned int M>
 int exec_op(){
     Operation op = op_list[pc];
+    [[maybe_unused]] unsigned int op_pc = pc;
     
-    // 統計モードの場合、行数ごとの実行回数を更新
-    #ifdef EXTENDED
-    if(is_stat){
-        int l = id_to_line.left.at(pc);
-        if(l > 0) ++line_exec_count[l-1];
-    }
-    #endif
+    // 統計モードの場合、命令ごとの実行回数を更新
+    if constexpr(M & f_stat) ++pc_exec_count[pc];
 
     // ブートローダ用処理(bootloader.sの内容に依存しているので注意！) -> 廃止
     #ifdef EXTENDED
@@ -822,11 +940,11 @@ int exec_op(){
     #endif
 
     // レイトレに対する無限ループ検知
-    #ifdef EXTENDED
-    if(is_raytracing && is_cautious && op_count() >= max_op_count){
-        throw std::runtime_error("too many operations executed for raytracing program");
+    if constexpr((M & f_raytracing) && (M & f_cautious)){
+        if(op_count() >= max_op_count){
+            throw std::runtime_error("too many operations executed for raytracing program");
+        }
     }
-    #endif
 
     // 実行部分
     switch(op.type){
@@ -861,7 +979,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fabs:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, std::abs(reg_fp.read_float(op.rs1)));
             }else{
                 reg_fp.write_32(op.rd, fpu.fabs(reg_fp.read_32(op.rs1)));
@@ -870,7 +988,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fneg:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, - reg_fp.read_float(op.rs1));
             }else{
                 reg_fp.write_32(op.rd, fpu.fneg(reg_fp.read_32(op.rs1)));
@@ -879,7 +997,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fdiv:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, reg_fp.read_float(op.rs1) / reg_fp.read_float(op.rs2));
             }else{
                 reg_fp.write_32(op.rd, fpu.fdiv(reg_fp.read_32(op.rs1), reg_fp.read_32(op.rs2)));
@@ -888,7 +1006,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fsqrt:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, std::sqrt(reg_fp.read_float(op.rs1)));
             }else{
                 reg_fp.write_32(op.rd, fpu.fsqrt(reg_fp.read_32(op.rs1)));
@@ -897,7 +1015,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fcvtif:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, static_cast<float>(reg_fp.read_int(op.rs1)));
             }else{
                 reg_fp.write_32(op.rd, fpu.itof(reg_fp.read_32(op.rs1)));
@@ -906,7 +1024,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fcvtfi:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, static_cast<int>(std::nearbyint(reg_fp.read_float(op.rs1))));
             }else{
                 reg_fp.write_32(op.rd, fpu.ftoi(reg_fp.read_32(op.rs1)));
@@ -920,7 +1038,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fadd:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, reg_fp.read_float(op.rs1) + reg_fp.read_float(op.rs2));
             }else{
                 reg_fp.write_32(op.rd, fpu.fadd(reg_fp.read_32(op.rs1), reg_fp.read_32(op.rs2)));
@@ -929,7 +1047,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fsub:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, reg_fp.read_float(op.rs1) - reg_fp.read_float(op.rs2));
             }else{
                 reg_fp.write_32(op.rd, fpu.fsub(reg_fp.read_32(op.rs1), reg_fp.read_32(op.rs2)));
@@ -938,7 +1056,7 @@ int exec_op(){
             ++pc;
             break;
         case o_fmul:
-            if(is_ieee){
+            if constexpr(M & f_ieee){
                 reg_fp.write_float(op.rd, reg_fp.read_float(op.rs1) * reg_fp.read_float(op.rs2));
             }else{
                 reg_fp.write_32(op.rd, fpu.fmul(reg_fp.read_32(op.rs1), reg_fp.read_32(op.rs2)));
@@ -949,33 +1067,25 @@ int exec_op(){
         case o_beq:
             reg_int.read_int(op.rs1) == reg_int.read_int(op.rs2) ? pc += op.imm : ++pc;
             ++op_type_count[o_beq];
-            #ifdef EXTENDED
-            branch_predictor.update(pc, reg_int.read_int(op.rs1) == reg_int.read_int(op.rs2));
-            #endif
+            if constexpr(M & f_gshare) branch_predictor.update(pc, reg_int.read_int(op.rs1) == reg_int.read_int(op.rs2));
             break;
         case o_blt:
             reg_int.read_int(op.rs1) < reg_int.read_int(op.rs2) ? pc += op.imm : ++pc;
             ++op_type_count[o_blt];
-            #ifdef EXTENDED
-            branch_predictor.update(pc, reg_int.read_int(op.rs1) < reg_int.read_int(op.rs2));
-            #endif
+            if constexpr(M & f_gshare) branch_predictor.update(pc, reg_int.read_int(op.rs1) < reg_int.read_int(op.rs2));
             break;
         case o_fbeq:
             reg_fp.read_float(op.rs1) == reg_fp.read_float(op.rs2) ? pc += op.imm : ++pc;
             ++op_type_count[o_fbeq];
-            #ifdef EXTENDED
-            branch_predictor.update(pc, reg_fp.read_float(op.rs1) == reg_fp.read_float(op.rs2));
-            #endif
+            if constexpr(M & f_gshare) branch_predictor.update(pc, reg_fp.read_float(op.rs1) == reg_fp.read_float(op.rs2));
             break;
         case o_fblt:
             reg_fp.read_float(op.rs1) < reg_fp.read_float(op.rs2) ? pc += op.imm : ++pc;
             ++op_type_count[o_fblt];
-            #ifdef EXTENDED
-            branch_predictor.update(pc, reg_fp.read_float(op.rs1) < reg_fp.read_float(op.rs2));
-            #endif
+            if constexpr(M & f_gshare) branch_predictor.update(pc, reg_fp.read_float(op.rs1) < reg_fp.read_float(op.rs2));
             break;
         case o_sw:
-            write_memory(reg_int.read_int(op.rs1) + op.imm, reg_int.read_32(op.rs2));
+            write_memory<M>(reg_int.read_int(op.rs1) + op.imm, reg_int.read_32(op.rs2));
             ++op_type_count[o_sw];
             ++pc;
             break;
@@ -985,12 +1095,12 @@ int exec_op(){
             ++pc;
             break;
         case o_std:
-            send_buffer.push(reg_int.read_int(op.rs2));
+            output_std(reg_int.read_int(op.rs2));
             ++op_type_count[o_std];
             ++pc;
             break;
         case o_fsw:
-            write_memory(reg_int.read_int(op.rs1) + op.imm, reg_fp.read_32(op.rs2));
+            write_memory<M>(reg_int.read_int(op.rs1) + op.imm, reg_fp.read_32(op.rs2));
             ++op_type_count[o_fsw];
             ++pc;
             break;
@@ -1020,7 +1130,7 @@ int exec_op(){
             ++pc;
             break;
         case o_lw:
-            reg_int.write_32(op.rd, read_memory(reg_int.read_int(op.rs1) + op.imm));
+            reg_int.write_32(op.rd, read_memory<M>(reg_int.read_int(op.rs1) + op.imm));
             ++op_type_count[o_lw];
             ++pc;
             break;
@@ -1044,7 +1154,7 @@ int exec_op(){
             ++pc;
             break;
         case o_flw:
-            reg_fp.write_32(op.rd, read_memory(reg_int.read_int(op.rs1) + op.imm));
+            reg_fp.write_32(op.rd, read_memory<M>(reg_int.read_int(op.rs1) + op.imm));
             ++op_type_count[o_flw];
             ++pc;
             break;
@@ -1080,16 +1190,61 @@ int exec_op(){
             throw std::runtime_error("error in executing the code (at pc " + std::to_string(pc) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(pc))) : "") + ")");
     }
 
-    #ifdef EXTENDED
-    int x2 = reg_int.read_int(2);
-    max_x2 = (x2 > max_x2) ? x2 : max_x2;
-    #endif
+    if constexpr(M & f_stat){ // 関数の呼び出し・復帰
+        if(op.type == o_jal || op.type == o_jalr) call_graph.update(op.type, op.rd, op_pc, pc, op_count());
+    }
+    if constexpr((M & f_stat) && (M & f_raytracing)){ // スタックの大きさ (統計モードのレイトレでのみ出力する)
+        int x2 = reg_int.read_int(2);
+        max_x2 = (x2 > max_x2) ? x2 : max_x2;
+    }
 
     return (pc >= code_size || op.is_exit()) ? sim_state_end : sim_state_continue;
 }
 
+template<unsigned int M>
+int run_until_end(){
+    int state;
+    while((state = exec_op<M>()) != sim_state_end);
+    return state;
+}
+
+// サンプリングしながら終了までexec_opを繰り返す (Sはスタックを記録するかどうか)
+template<unsigned int M, bool S>
+int run_sampling_loop(){
+    unsigned long long chunk = sampling_profiler.chunk();
+    while(true){
+        for(unsigned long long n=chunk; n>0; --n){
+            int state;
+            if constexpr(S){
+                unsigned int old_pc = pc;
+                Otype type = op_list[pc].type;
+                unsigned int rd = op_list[pc].rd;
+                state = exec_op<M>();
+                if(type == o_jal || type == o_jalr) sampling_profiler.stack.update(type, rd, old_pc, pc);
+            }else{
+                state = exec_op<M>();
+            }
+            if(state == sim_state_end) return state;
+        }
+        sampling_profiler.poll(pc);
+    }
+}
+
+template<unsigned int M>
+int run_sampling(){
+    sampling_profiler.start(pc);
+    int state = sampling_profiler.is_stack ? run_sampling_loop<M, true>() : run_sampling_loop<M, false>();
+    sampling_profiler.stop();
+    return state;
+}
+
+// 有効な機能に応じて特殊化されたexec_opを呼ぶ
+int exec_op(){
+    return exec_op_table[feature_mask]();
+}
+
 int exec_op(const std::string& bp){
-    int res = exec_op();
+    int res = is_debug ? history.exec() : exec_op();
 
     if(is_debug && bp != ""){
         if(bp == "__continue"){ // continue, 名前指定なし
@@ -1117,6 +1272,9 @@ void output_info(){
     ss << "# execution stat" << std::endl;
     ss << "- execution time(s): " << exec_time << std::endl;
     ss << "- operations per second: " << op_per_sec << std::endl;
+    #ifdef EXTENDED
+    ss << "- host CPU time of I/O threads(s): receive " << io_cpu_time_receive << ", send " << io_cpu_time_send << std::endl;
+    #endif
     ss << std::endl;
 
     ss << "# basic stat" << std::endl;
@@ -1125,9 +1283,15 @@ void output_info(){
         ss << "- cache:" << std::endl;
         ss << "\t- line num: " << std::pow(2, index_width_) << std::endl;
         ss << "\t- block size: " << std::pow(2, offset_width_) << std::endl;
+        ss << "\t- ways: " << cache.way_num << " (" << string_of_replacement(cache.replacement) << ", " << (cache.is_write_back ? "write-back" : "write-through") << ", " << (cache.is_write_allocate ? "write-allocate" : "no-write-allocate") << ")" << std::endl;
         ss << "\t- accessed: " << cache.accessed_times << std::endl;
         ss << "\t- hit: " << cache.hit_times << std::endl;
         ss << "\t- hit rate: " << static_cast<double>(cache.hit_times) / cache.accessed_times << std::endl;
+        ss << "\t- miss (read/write): " << cache.read_miss_times << "/" << cache.write_miss_times << std::endl;
+        ss << "\t- write-back: " << cache.writeback_times << std::endl;
+        ss << "\t- write-through: " << cache.write_through_times << std::endl;
+        ss << "\t- stall cycles: " << cache.stall_cycles << std::endl;
+        ss << "- estimated execution time (1 clock per operation + cache stalls): " << estimated_time() << std::endl;
     }
     if(is_stat && is_raytracing){
         ss << "- stack:" << std::endl;
@@ -1176,45 +1340,72 @@ void output_info(){
             std::exit(EXIT_FAILURE);
         }
         std::stringstream ss_exec;
-        ss_exec << "line,exec" << std::endl;
-        for(int i=0; i<input_line_num; ++i){
-            ss_exec << i+1 << "," << line_exec_count[i] << std::endl;
+        if(is_debug){ // 行ごとに集計
+            std::vector<unsigned long long> line_exec_count(input_line_num, 0);
+            for(auto& x : id_to_line.left){
+                if(x.second > 0 && x.second <= input_line_num) line_exec_count[x.second - 1] += pc_exec_count[x.first];
+            }
+            ss_exec << "line,exec" << std::endl;
+            for(int i=0; i<input_line_num; ++i){
+                ss_exec << i+1 << "," << line_exec_count[i] << std::endl;
+            }
+        }else{ // 行番号の情報がないので命令ごとに出力
+            ss_exec << "pc,exec" << std::endl;
+            for(unsigned int i=0; i<op_list.size(); ++i){
+                ss_exec << i << "," << pc_exec_count[i] << std::endl;
+            }
         }
         output_file_exec << ss_exec.str();
         std::cout << head << "execution info: " << output_filename_exec << std::endl;
+
+        // 関数ごとの実行命令数
+        call_graph.finish(op_count());
+        call_graph.write("./info/" + filename + "_callgraph_" + timestamp + ".csv", "./info/" + filename + "_calls_" + timestamp + ".csv");
     }
 
     return;
 }
 
+template<unsigned int M>
 inline Bit32 read_memory(int w){
-    #ifdef EXTENDED
-    if(is_cautious){
+    if constexpr(M & f_cautious){
         if(w < 0 || w > memory_border) throw std::runtime_error("invalid memory access");
     }
-    if(is_stat){
+    if constexpr(M & f_stat){
         ++mem_accessed_read[w];
-        if(is_raytracing) w < stack_border ? ++stack_accessed_read_count : ++heap_accessed_read_count;
+        if constexpr(M & f_raytracing) w < stack_border ? ++stack_accessed_read_count : ++heap_accessed_read_count;
+    }
+    if constexpr(M & f_cache){
+        cache.read(w);
+        if(is_cache_analysis) cache_analyzer.access(w);
     }
-    if(is_cache_enabled) cache.read(w);
-    #endif
     return memory.read(w);
 }
 
+template<unsigned int M>
 inline void write_memory(int w, const Bit32& v){
-    #ifdef EXTENDED
-    if(is_cautious){
+    if constexpr(M & f_cautious){
         if(w < 0 || w > memory_border) throw std::runtime_error("invalid memory access");
     }
-    if(is_stat){
+    if constexpr(M & f_stat){
         ++mem_accessed_write[w];
-        if(is_raytracing) w < stack_border ? ++stack_accessed_write_count : ++heap_accessed_write_count;
+        if constexpr(M & f_raytracing) w < stack_border ? ++stack_accessed_write_count : ++heap_accessed_write_count;
+    }
+    if constexpr(M & f_cache){
+        cache.write(w);
+        if(is_cache_analysis) cache_analyzer.access(w);
     }
-    if(is_cache_enabled) cache.write(w);
-    #endif
     memory.write(w, v);
 }
 
+Bit32 read_memory(int w){
+    return read_memory_table[feature_mask](w);
+}
+
+void write_memory(int w, const Bit32& v){
+    write_memory_table[feature_mask](w, v);
+}
+
 // 実行命令の総数を返す
 unsigned long long op_count(){
     unsigned long long acc = 0;
@@ -1224,6 +1415,11 @@ unsigned long long op_count(){
     return acc;
 }
 
+// 1命令1クロックで、キャッシュのミスによるストールのみを加えた実行時間の見積もり (転送時間を含む)
+double estimated_time(){
+    return transmission_time + static_cast<double>(op_count() + cache.stall_cycles) / static_cast<double>(frequency);
+}
+
 // 実行情報を表示したうえで異常終了
 void exit_with_output(std::exception& e){
     std::cout << head_error << e.what() << std::endl;
@@ -1234,6 +1430,10 @@ void exit_with_output(std::exception& e){
         std::cout << head << "execution info until now:" << std::endl;
         exec_command("info");
     }
+    if(output_sink.is_open()){ // 途中までの出力を残す
+        output_sink.close();
+        output_sink.report(head);
+    }
     std::cout << head << "abnormal end" << std::endl;
     std::quick_exit(EXIT_FAILURE);
 }
@@ -1,30 +1,75 @@
 #pragma once
 #include <common.hpp>
 #include <unit.hpp>
+#include <sink.hpp>
+#include <fpu.hpp>
 #include <string>
-#include <boost/bimap/bimap.hpp>
+#include <vector>
+#include <loader.hpp>
 #include <exception>
 
-/* typedef宣言 */
-// boost::bimaps関連の略記
-typedef boost::bimaps::bimap<std::string, unsigned int> bimap_t;
-typedef bimap_t::value_type bimap_value_t;
-typedef boost::bimaps::bimap<unsigned int, int> bimap_t2;
-typedef bimap_t2::value_type bimap_value_t2;
+/* 実行エンジンの種類 */
+enum class Etype{
+    e_switch, // exec_opによる1命令ずつの実行
+    e_threaded, // direct-threaded方式(threaded.hpp)
+    e_block, // 基本ブロック単位の実行(block.hpp)
+    e_jit // x86-64向けのJIT(jit.hpp)
+};
+
+/* 有効な機能を表すビット (exec_opなどのテンプレート引数) */
+// 機能の有無による速度の差はこのマスクで解消しているので、simとsim+を分けているのは入出力の方式の違い(ファイル/サーバとの通信スレッド)のため
+inline constexpr unsigned int f_ieee = 1 << 0;
+inline constexpr unsigned int f_stat = 1 << 1;
+inline constexpr unsigned int f_cache = 1 << 2;
+inline constexpr unsigned int f_cautious = 1 << 3;
+inline constexpr unsigned int f_raytracing = 1 << 4; // 統計モード・cautiousモードと併用した場合のみ意味を持つ
+inline constexpr unsigned int f_gshare = 1 << 5;
+#ifdef EXTENDED
+inline constexpr unsigned int feature_num = 1 << 6; // ビットの組み合わせの総数
+#else
+inline constexpr unsigned int feature_num = 1 << 1; // simで指定できるのはIEEE754モードのみ (他の機能のオプションはsim+にしかない)
+#endif
 
 /* extern宣言 */
+extern std::vector<Operation> op_list;
+extern Reg reg_int;
+extern Reg reg_fp;
+extern Memory memory;
+extern Cache cache;
+extern Fpu fpu;
+extern Gshare branch_predictor;
+extern unsigned int pc;
+extern unsigned int code_size;
+extern bool is_debug;
+extern bool is_ieee;
+extern bool is_gshare_enabled;
+extern unsigned long long op_type_count[];
+extern bimap_t2 id_to_line;
 extern int port;
+extern bool is_unix_socket;
 extern TransmissionQueue receive_buffer;
 extern TransmissionQueue send_buffer;
 extern bool is_raytracing;
+#ifdef EXTENDED
+extern double io_cpu_time_send;
+#endif
 
 /* プロトタイプ宣言 */
 void simulate(); // シミュレーションの本体処理
 bool exec_command(std::string); // デバッグモードのコマンドを認識して実行
 void output_info(); // 情報の出力
+template<unsigned int M> int exec_op(); // 命令を実行し、PCを変化させる(機能ごとに特殊化したもの)
+template<unsigned int M> int run_until_end(); // 終了までexec_opを繰り返す
+template<unsigned int M> int run_sampling(); // サンプリングしながら終了までexec_opを繰り返す
 int exec_op(); // 命令を実行し、PCを変化させる
 int exec_op(const std::string&);
+int exec_threaded(); // direct-threaded方式で終了まで実行
+int exec_block(); // 基本ブロック単位で終了まで実行
+int exec_jit(); // JITで終了まで実行
+template<unsigned int M> Bit32 read_memory(int);
+template<unsigned int M> void write_memory(int, const Bit32&);
 Bit32 read_memory(int); // メモリ読み出し(class Memoryのラッパー関数)
 void write_memory(int, const Bit32&); // メモリ書き込み(class Memoryのラッパー関数)
 unsigned long long op_count(); // 実行命令の総数を返す
+double estimated_time(); // キャッシュのストールを考慮した実行時間の見積もり
 void exit_with_output(std::exception&); // 実行情報を表示したうえで異常終了
@@ -29,8 +29,17 @@ Reg reg_fp; // 浮動小数点数レジスタ
 Memory_with_cache memory; // メモリ(キャッシュは内部)
 Fpu fpu; // FPU
 TransmissionQueue receive_buffer; // 外部通信での受信バッファ
-TransmissionQueue send_buffer; // 外部通信での受信バッファ
+TransmissionQueue send_buffer; // 外部通信での送信バッファ
+Output_sink output_sink; // stdの出力先 (開かれていなければ送信バッファに積む)
+
+// 読み込み直後の状態 (initで書き戻す)
+Memory_snapshot initial_memory;
+Cache initial_cache;
+TransmissionQueue initial_receive_buffer;
+std::vector<Operation> initial_op_list;
 BranchPredictor branch_predictor; // 分岐予測器
+Uart uart; // UARTの送受信のタイミング (--uartのときのみ使用)
+Call_graph_profiler call_graph; // 関数ごとのクロック数 (--call-graphのときのみ使用)
 
 unsigned int code_size = 0; // コードサイズ
 int mem_size = 100; // メモリサイズ
@@ -41,9 +50,14 @@ bool is_debug = false; // デバッグモード
 bool is_bin = false; // バイナリファイルモード
 bool is_raytracing = false; // レイトレ専用モード
 bool is_ieee = false; // IEEE754に従って浮動小数演算を行うモード
+bool is_uart = false; // UARTの送受信のタイミングを模擬するモード
+bool is_call_graph = false; // 関数ごとのクロック数を集計するモード
 bool is_preloading = false; // バッファのデータを予め取得しておくモード
+bool is_image = false; // 変換済みのイメージ(.simimg)を読み込むモード
+bool is_making_image = false; // イメージ(.simimg)に変換するモード
 std::string filename; // 処理対象のファイル名
 std::string preload_filename; // プリロード対象のファイル名
+std::string sink_filename; // stdの出力を直接書き出すファイル名
 unsigned int bp_counter = 0; // ブレークポイント自動命名のときに使う数字
 
 // 統計・出力関連
@@ -74,7 +88,12 @@ int main(int argc, char *argv[]){
         ("mem,m", po::value<int>(), "memory size")
         ("raytracing,r", "specialized for ray-tracing program")
         ("ieee", "IEEE754 mode")
-        ("preload", po::value<std::string>()->implicit_value("contest"), "data preload");
+        ("uart", "cycle-accurate UART model")
+        ("call-graph", "clock counts per function")
+        ("preload", po::value<std::string>()->implicit_value("contest"), "data preload")
+        ("image", "load a precompiled image (.simimg)")
+        ("make-image", "convert into a precompiled image (.simimg)")
+        ("output,o", po::value<std::string>(), "stream the output of std into the file during execution (- for stdout)");
 	po::variables_map vm;
     try{
         po::store(po::parse_command_line(argc, argv, opt), vm);
@@ -100,10 +119,15 @@ int main(int argc, char *argv[]){
     if(vm.count("mem")) mem_size = vm["mem"].as<int>();
     if(vm.count("raytracing")) is_raytracing = true;
     if(vm.count("ieee")) is_ieee = true;
+    if(vm.count("uart")) is_uart = true;
+    if(vm.count("call-graph")) is_call_graph = true;
     if(vm.count("preload")){
         is_preloading = true;
         preload_filename = vm["preload"].as<std::string>();
     };
+    if(vm.count("image")) is_image = true;
+    if(vm.count("make-image")) is_making_image = true;
+    if(vm.count("output")) sink_filename = vm["output"].as<std::string>();
 
     // 命令数カウントの初期化
     op_type_count = (unsigned long long*) calloc(op_type_num, sizeof(unsigned long long));
@@ -146,116 +170,76 @@ int main(int argc, char *argv[]){
     // バッファのデータのプリロード
     if(is_preloading){
         preload_filename = "./data/" + preload_filename + ".bin";
-        std::ifstream preload_file(preload_filename, std::ios::in | std::ios::binary);
-        if(!preload_file){
-            std::cerr << head_error << "could not open " << preload_filename << std::endl;
-            std::exit(EXIT_FAILURE);
-        }
-        unsigned char c;
-        while(!preload_file.eof()){
-            preload_file.read((char*) &c, sizeof(char)); // 8bit取り出す
-            receive_buffer.push(Bit32(static_cast<int>(c)));
-        }
+        preload_data(preload_filename, receive_buffer);
         std::cout << head << "preloaded data to the receive-buffer from " + preload_filename << std::endl;
     }
 
     // ファイルを読む
     std::string input_filename;
-    input_filename = "./code/" + filename + (is_bin ? ".bin" : (is_debug ? ".dbg" : ""));
-    std::ifstream input_file(input_filename);
-    if(!input_file.is_open()){
-        std::cerr << head_error << "could not open " << input_filename << std::endl;
-        std::exit(EXIT_FAILURE);
+    input_filename = "./code/" + filename + (is_image ? ".simimg" : (is_bin ? ".bin" : (is_debug ? ".dbg" : "")));
+    int last_line = 0;
+    unsigned int code_id;
+    if(is_image){ // デコード済みの命令列などをそのまま読み込む (プリロードを指定していなければ含まれるデータを使う)
+        code_id = load_image(input_filename, last_line, is_preloading ? nullptr : &receive_buffer);
+    }else{ // ファイルの各行をパースしてop_listに追加
+        code_id = load_code(input_filename, is_bin, 0, last_line);
     }
 
-    // ファイルの各行をパースしてop_listに追加
-    std::string code;
-    std::string code_keep; // 空白でない最後の行を保存
-    unsigned int code_id = 0;
-    if(!is_bin){
-        std::regex regex_empty = std::regex("^\\s*\\r?\\n?$");
-        std::regex regex_dbg = std::regex("^\\d{32}@(-?\\d+)$");
-        std::regex regex_dbg_label = std::regex("^\\d{32}@(-?\\d+)#(([a-zA-Z_]\\w*(.\\d+)*))$");
-        std::regex regex_dbg_bp = std::regex("^\\d{32}@(-?\\d+)!(([a-zA-Z_]\\w*(.\\d+)*))$");
-        std::regex regex_dbg_label_bp = std::regex("^\\d{32}@(-?\\d+)#(([a-zA-Z_]\\w*(.\\d+)*))!(([a-zA-Z_]\\w*(.\\d+)*))$");
-        std::smatch match;
-        while(std::getline(input_file, code)){
-            if(std::regex_match(code, regex_empty)){ // 空行は無視
-                continue;
-            }else{
-                op_list.emplace_back(Operation(code));
-                
-                // ラベル・ブレークポイントの処理
-                if(code.size() > 32){
-                    if(is_debug){ // デバッグモード
-                        if(std::regex_match(code, match, regex_dbg)){
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                        }else if(std::regex_match(code, match, regex_dbg_label)){ // ラベルのみ
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                            label_to_id.insert(bimap_value_t(match[2].str(), code_id));             
-                        }else if(std::regex_match(code, match, regex_dbg_bp)){ // ブレークポイントのみ
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                            bp_to_id.insert(bimap_value_t(match[2].str(), code_id));
-                        }else if(std::regex_match(code, match, regex_dbg_label_bp)){ // ラベルとブレークポイントの両方
-                            id_to_line.insert(bimap_value_t2(code_id, std::stoi(match[1].str())));
-                            label_to_id.insert(bimap_value_t(match[2].str(), code_id));
-                            bp_to_id.insert(bimap_value_t(match[3].str(), code_id));
-                        }else{
-                            std::cerr << head_error << "could not parse the code" << std::endl;
-                            std::exit(EXIT_FAILURE);
-                        }
-                    }else{ // デバッグモードでないのにラベルやブレークポイントの情報が入っている場合エラー
-                        std::cerr << head_error << "could not parse the code (maybe it is encoded in debug-style)" << std::endl;
-                        std::exit(EXIT_FAILURE);
-                    }
-                }
+    code_size = code_id;
 
-                ++code_id;
-                code_keep = code;
-            }
-        }
-    }else{
-        int read_state = 0;
-        unsigned char c;
-        int acc = 0;
-        while(!input_file.eof()){
-            input_file.read((char*) &c, sizeof(char)); // 8bit取り出す
-            acc += static_cast<int>(c) << ((3 - read_state) * 8);
-            ++read_state;
-            if(read_state == 4){
-                op_list.emplace_back(Operation(acc));
-                acc = 0;
-                read_state = 0;
-                ++code_id;
-            }
+    // イメージへの変換
+    if(is_making_image){
+        std::string image_filename = "./code/" + filename + ".simimg";
+        write_image(image_filename, code_size, last_line, is_preloading ? preload_filename : "");
+        std::cout << head << "converted into " << image_filename << std::endl;
+        std::exit(EXIT_SUCCESS);
+    }
+    op_list.resize(code_id + 5); // segmentation fault防止のために余裕を持たせる
+
+    // stdの出力先を開く (デバッグなしモードのレイトレでは、画像を実行中に直接書き出す)
+    if(!sink_filename.empty() || (is_raytracing && !is_debug)){
+        std::string sink_path = sink_filename.empty() ? "./out/output_" + timestamp + ".ppm" : sink_filename;
+        if(!output_sink.open(sink_path, is_raytracing || sink_path.ends_with(".ppm"))){
+            std::cerr << head_error << "could not open " << sink_path << std::endl;
+            std::exit(EXIT_FAILURE);
         }
+        std::cout << head << "streaming the output to " << sink_path << std::endl;
     }
 
-    code_size = code_id;
-    op_list.resize(code_id + 5); // segmentation fault防止のために余裕を持たせる
+    // 初期状態を保存
+    initial_memory.capture(memory);
+    initial_cache = Cache(index_width, offset_width, cache_way_num);
+    initial_cache.copy_from(memory.cache);
+    initial_receive_buffer = receive_buffer;
+    initial_op_list = op_list;
+    if(is_call_graph) call_graph.reset(0, 0);
 
     // シミュレーションの起動
     simulate();
 
     // 実行結果の情報を出力
     // if(is_info_output || is_detailed_debug) output_info();
+    if(is_call_graph){
+        call_graph.finish(config.clk);
+        call_graph.write("./info/" + filename + "_callgraph2_" + timestamp + ".csv", "./info/" + filename + "_calls2_" + timestamp + ".csv");
+    }
 
-    // レイトレの場合は画像も出力
-    if(is_raytracing && sim_state == sim_state_end){
+    // stdの出力を閉じる (直接書き出していないレイトレの場合は、ここで送信バッファの内容を画像として出力)
+    if(output_sink.is_open()){
+        output_sink.close();
+        output_sink.report(head);
+    }else if(is_raytracing && sim_state == sim_state_end){
         if(!send_buffer.empty()){
             std::string output_filename = "./out/output_" + timestamp + ".ppm";
-            std::ofstream output_file(output_filename);
-            if(!output_file){
+            if(!output_sink.open(output_filename, true)){
                 std::cerr << head_error << "could not open " << output_filename << std::endl;
                 std::exit(EXIT_FAILURE);
             }
-            std::stringstream output;
-            Bit32 b32;
             while(!send_buffer.empty()){
-                output << (unsigned char) send_buffer.pop().i;
+                output_sink.put(static_cast<unsigned char>(send_buffer.pop().i));
             }
-            output_file << output.str();
-            std::cout << head << "output image written in " << output_filename << std::endl;
+            output_sink.close();
+            output_sink.report(head);
         }else{
             std::cout << head_error << "send-buffer is empty" << std::endl;
         }
@@ -365,8 +349,29 @@ bool exec_command(std::string cmd){
 
                 std::cout << head << "clock count: " << config.clk << std::endl;
                 std::cout << head << "prediction: " << std::endl;
-                std::cout << head_space << "- execution time: " << transmission_time + static_cast<double>(config.clk) / static_cast<double>(frequency) << std::endl;
+                if(is_uart){ // 送信用のfifoが空になるまでを実行時間とする (受信の待ち時間はclkに含まれている)
+                    double end_clk = std::max(static_cast<double>(config.clk), uart.send_done);
+                    std::cout << head_space << "- execution time: " << end_clk / static_cast<double>(frequency) << std::endl;
+                }else{
+                    std::cout << head_space << "- execution time: " << transmission_time + static_cast<double>(config.clk) / static_cast<double>(frequency) << std::endl;
+                }
                 std::cout << head_space << "- clocks per instruction: " << static_cast<double>(config.clk) / static_cast<double>(cnt) << std::endl;
+                // パイプラインのタイミングはキャッシュのミスで変わらないので、ストールは別に加算して見積もる
+                const Cache& c = memory.cache;
+                std::cout << head << "cache (" << c.way_num << "-way, " << string_of_replacement(c.replacement) << "): " << std::endl;
+                std::cout << head_space << "- hit rate: " << (c.accessed_times > 0 ? static_cast<double>(c.hit_times) / static_cast<double>(c.accessed_times) : 0.0) << " (" << c.hit_times << "/" << c.accessed_times << ")" << std::endl;
+                std::cout << head_space << "- miss (read/write): " << c.read_miss_times << "/" << c.write_miss_times << ", write-back: " << c.writeback_times << std::endl;
+                std::cout << head_space << "- stall cycles: " << c.stall_cycles << std::endl;
+                std::cout << head_space << "- execution time with cache stalls: " << transmission_time + static_cast<double>(config.clk + c.stall_cycles) / static_cast<double>(frequency) << std::endl;
+                if(is_uart){
+                    std::cout << head << "uart: " << std::endl;
+                    std::cout << head_space << "- received bytes: " << uart.received_num << std::endl;
+                    std::cout << head_space << "- lre returned empty before arrival: " << uart.receive_wait_count << std::endl;
+                    std::cout << head_space << "- clocks stalled by lrd before arrival: " << uart.receive_stall_cycles << std::endl;
+                    std::cout << head_space << "- ltf returned full: " << uart.send_full_count << std::endl;
+                    std::cout << head_space << "- send fifo overflows: " << uart.overflow_count << std::endl;
+                    std::cout << head_space << "- send fifo drained at clock: " << static_cast<unsigned long long>(std::ceil(uart.send_done)) << std::endl;
+                }
             }
         }else{
             std::cout << head_info << "no operation is left to be simulated" << std::endl;
@@ -374,10 +379,18 @@ bool exec_command(std::string cmd){
     }else if(std::regex_match(cmd, std::regex("^\\s*(i|(init))\\s*$"))){ // init
         sim_state = sim_state_continue;
         config = Configuration();
+        uart = Uart();
+        output_sink.restart();
         for(unsigned int i=0; i<op_type_num; ++i) op_type_count[i] = 0;
         reg_int = Reg();
         reg_fp = Reg();
-        memory = Memory_with_cache(mem_size, index_width, offset_width);
+        initial_memory.restore(memory); // 領域を確保し直さずに読み込み直後の状態を書き戻す
+        memory.cache.copy_from(initial_cache);
+        branch_predictor = BranchPredictor();
+        receive_buffer = initial_receive_buffer;
+        send_buffer = TransmissionQueue();
+        op_list = initial_op_list;
+        if(is_call_graph) call_graph.reset(0, 0);
         std::cout << head_info << "simulation environment is now initialized" << std::endl;
     }else if(std::regex_match(cmd, std::regex("^\\s*(ir|(init run))\\s*$"))){ // init run
         exec_command("init");
@@ -562,7 +575,9 @@ bool exec_command(std::string cmd){
                 receive_buffer.print(size);
             }
         }else if(match[3].str() == "sbuf"){
-            if(send_buffer.empty()){
+            if(output_sink.is_open()){
+                std::cout << "send buffer: (streamed to " << output_sink.name() << ", " << output_sink.size() << " bytes)" << std::endl;
+            }else if(send_buffer.empty()){
                 std::cout << "send buffer: (empty)" << std::endl;
             }else{
                 std::cout << "send buffer:\n  ";
@@ -666,7 +681,9 @@ bool exec_command(std::string cmd){
             std::cout << head_error << "breakpoint '" << bp_id << "' has not been set" << std::endl;  
         }
     }else if(std::regex_match(cmd, match, std::regex("^\\s*(out)(\\s+(-p|-b))?(\\s+(-f)\\s+(\\w+))?\\s*$"))){ // out (option)
-        if(!send_buffer.empty()){
+        if(output_sink.is_open()){
+            std::cout << head_info << "send-buffer data is streamed to " << output_sink.name() << std::endl;
+        }else if(!send_buffer.empty()){
             bool is_ppm = match[3].str() == "-p";
             bool is_bin = match[3].str() == "-b";
             
@@ -732,6 +749,10 @@ unsigned long long op_count(){
 // 実行情報を表示したうえで異常終了
 void exit_with_output(std::exception& e){
     std::cout << head_error << e.what() << std::endl;
+    if(output_sink.is_open()){ // 途中までの出力を残す
+        output_sink.close();
+        output_sink.report(head);
+    }
     std::cout << head << "abnormal end" << std::endl;
     std::quick_exit(EXIT_FAILURE);
 }
@@ -1,19 +1,13 @@
 #pragma once
 #include <common.hpp>
 #include <unit.hpp>
+#include <sink.hpp>
 #include <fpu.hpp>
 #include <string>
 #include <vector>
-#include <boost/bimap/bimap.hpp>
+#include <loader.hpp>
 #include <exception>
 
-/* typedef宣言 */
-// boost::bimaps関連の略記
-typedef boost::bimaps::bimap<std::string, unsigned int> bimap_t;
-typedef bimap_t::value_type bimap_value_t;
-typedef boost::bimaps::bimap<unsigned int, int> bimap_t2;
-typedef bimap_t2::value_type bimap_value_t2;
-
 /* extern宣言 */
 extern std::vector<Operation> op_list;
 extern Reg reg_int;
@@ -24,9 +18,12 @@ extern unsigned int code_size;
 extern TransmissionQueue receive_buffer;
 extern TransmissionQueue send_buffer;
 extern BranchPredictor branch_predictor;
+extern Uart uart;
 extern bool is_debug;
 extern bool is_quick;
 extern bool is_ieee;
+extern bool is_uart;
+extern bool is_call_graph;
 extern bimap_t bp_to_id;
 extern bimap_t label_to_id;
 extern bimap_t2 id_to_line;
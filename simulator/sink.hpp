@@ -0,0 +1,244 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <chrono>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* stdの出力先 (実行中にファイルやパイプへ直接書き出す) */
+// 送信バッファに溜めずに1バイトずつバッファに書き、sink_buffer_sizeごとにまとめてwriteする
+// PPMの場合はヘッダを読みながら検証し、画像の行が揃った時点でも(sink_flush_interval以上経っていれば)書き出すので、実行中でも途中までの画像を確認できる
+class Output_sink{
+    private:
+        // PPMの検証の状態
+        enum class Ppm_state{
+            magic_p, magic_num, // "P3" or "P6"
+            header, // 幅・高さ・最大値 (空白区切り、'#'以降はコメント)
+            comment,
+            body, // 画素のデータ
+            done, // 画像が揃った
+            error
+        };
+        int fd = -1;
+        bool is_stdout = false;
+        bool is_regular_file = false;
+        std::string path;
+        std::vector<unsigned char> buf;
+        unsigned long long written = 0; // 書き込んだ総バイト数
+        std::chrono::steady_clock::time_point last_flush;
+        bool is_ppm = false;
+        Ppm_state state = Ppm_state::magic_p;
+        bool is_binary = false; // P6ならtrue
+        unsigned int header_fields[3] = {0, 0, 0}; // 幅・高さ・最大値
+        unsigned int field_num = 0; // 読み終えたヘッダの項目数
+        bool in_number = false;
+        unsigned int number = 0; // P3の画素値、またはヘッダの項目
+        unsigned long long sample_num = 0; // 読んだ画素値(RGBそれぞれ)の数
+        unsigned long long sample_expected = 0;
+        unsigned int bytes_per_sample = 1;
+        unsigned int byte_in_sample = 0;
+        std::string error_message;
+        unsigned long long error_at = 0;
+        void fail(const std::string& msg){
+            this->state = Ppm_state::error;
+            this->error_message = msg;
+            this->error_at = this->written + this->buf.size();
+        }
+        void end_header_field(){
+            this->header_fields[this->field_num++] = this->number;
+            this->number = 0;
+            this->in_number = false;
+            if(this->field_num == 3){
+                if(this->header_fields[0] == 0 || this->header_fields[1] == 0 || this->header_fields[2] == 0 || this->header_fields[2] > 65535){
+                    this->fail("invalid header values");
+                    return;
+                }
+                this->sample_expected = static_cast<unsigned long long>(this->header_fields[0]) * this->header_fields[1] * 3;
+                this->bytes_per_sample = this->header_fields[2] < 256 ? 1 : 2;
+                this->state = Ppm_state::body;
+            }
+        }
+        void end_sample(){
+            ++this->sample_num;
+            if(this->sample_num % (static_cast<unsigned long long>(this->header_fields[0]) * 3) == 0) this->flush_if_stale(); // 1行揃った
+            if(this->sample_num == this->sample_expected) this->state = Ppm_state::done;
+        }
+        void validate(unsigned char c){
+            switch(this->state){
+                case Ppm_state::magic_p:
+                    if(c == 'P') this->state = Ppm_state::magic_num; else this->fail("magic number is not 'P3' or 'P6'");
+                    return;
+                case Ppm_state::magic_num:
+                    if(c == '3' || c == '6'){
+                        this->is_binary = c == '6';
+                        this->state = Ppm_state::header;
+                    }else{
+                        this->fail("magic number is not 'P3' or 'P6'");
+                    }
+                    return;
+                case Ppm_state::comment:
+                    if(c == '\n' || c == '\r') this->state = Ppm_state::header;
+                    return;
+                case Ppm_state::header:
+                    if('0' <= c && c <= '9'){
+                        this->number = this->number * 10 + (c - '0');
+                        this->in_number = true;
+                        if(this->number > 65535) this->fail("header value is too large");
+                    }else if(c == ' ' || c == '\t' || c == '\n' || c == '\r'){
+                        if(this->in_number) this->end_header_field(); // 最大値の直後の空白1文字でヘッダが終わる
+                    }else if(c == '#' && !this->in_number){
+                        this->state = Ppm_state::comment;
+                    }else{
+                        this->fail("unexpected character in the header");
+                    }
+                    return;
+                case Ppm_state::body:
+                    if(this->is_binary){
+                        if(++this->byte_in_sample == this->bytes_per_sample){
+                            this->byte_in_sample = 0;
+                            this->end_sample();
+                        }
+                    }else{
+                        if('0' <= c && c <= '9'){
+                            this->number = this->number * 10 + (c - '0');
+                            this->in_number = true;
+                            if(this->number > this->header_fields[2]) this->fail("pixel value exceeds the maximum");
+                        }else if(c == ' ' || c == '\t' || c == '\n' || c == '\r'){
+                            if(this->in_number){
+                                this->number = 0;
+                                this->in_number = false;
+                                this->end_sample();
+                            }
+                        }else{
+                            this->fail("unexpected character in the pixel data");
+                        }
+                    }
+                    return;
+                case Ppm_state::done:
+                    if(this->is_binary || !(c == ' ' || c == '\t' || c == '\n' || c == '\r')) this->fail("trailing data after the image");
+                    return;
+                case Ppm_state::error: return;
+            }
+        }
+        void flush_if_stale(){
+            if(std::chrono::steady_clock::now() - this->last_flush >= std::chrono::milliseconds(sink_flush_interval)) this->flush();
+        }
+        void reset_state(){
+            this->buf.clear();
+            this->written = 0;
+            this->last_flush = std::chrono::steady_clock::now();
+            this->state = Ppm_state::magic_p;
+            this->field_num = 0;
+            this->in_number = false;
+            this->number = 0;
+            this->sample_num = 0;
+            this->sample_expected = 0;
+            this->byte_in_sample = 0;
+            this->error_message.clear();
+        }
+    public:
+        Output_sink(){}
+        Output_sink(const Output_sink&) = delete;
+        Output_sink& operator=(const Output_sink&) = delete;
+        ~Output_sink(){
+            this->close();
+        }
+        // 出力先を開く ("-"なら標準出力)
+        bool open(const std::string& path, bool is_ppm){
+            this->close();
+            this->path = path;
+            this->is_ppm = is_ppm;
+            if(path == "-"){
+                this->fd = STDOUT_FILENO;
+                this->is_stdout = true;
+                this->is_regular_file = false;
+            }else{
+                this->fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if(this->fd < 0) return false;
+                this->is_stdout = false;
+                this->is_regular_file = lseek(this->fd, 0, SEEK_CUR) >= 0; // パイプなどでなければ、initの際に先頭から書き直せる
+            }
+            this->buf.reserve(sink_buffer_size);
+            this->reset_state();
+            return true;
+        }
+        bool is_open() const {
+            return this->fd >= 0;
+        }
+        const std::string& name() const {
+            return this->path;
+        }
+        void put(unsigned char c){
+            if(this->is_ppm) this->validate(c);
+            this->buf.push_back(c);
+            if(this->buf.size() >= sink_buffer_size) this->flush();
+        }
+        void flush(){
+            const unsigned char* p = this->buf.data();
+            std::size_t rest = this->buf.size();
+            while(rest > 0){
+                ssize_t n = write(this->fd, p, rest);
+                if(n < 0){
+                    if(errno == EINTR) continue;
+                    throw std::runtime_error("could not write to " + this->path);
+                }
+                p += n;
+                rest -= n;
+            }
+            this->written += this->buf.size();
+            this->buf.clear();
+            this->last_flush = std::chrono::steady_clock::now();
+        }
+        // シミュレーションの初期化に合わせて最初から書き直す (パイプの場合は検証のみやり直す)
+        void restart(){
+            if(!this->is_open()) return;
+            if(this->is_regular_file){
+                if(ftruncate(this->fd, 0) != 0 || lseek(this->fd, 0, SEEK_SET) < 0){
+                    throw std::runtime_error("could not rewind " + this->path);
+                }
+            }else{
+                this->flush();
+            }
+            this->reset_state();
+        }
+        void close(){
+            if(!this->is_open()) return;
+            this->flush();
+            if(!this->is_stdout) ::close(this->fd);
+            this->fd = -1;
+        }
+        unsigned long long size() const {
+            return this->written + this->buf.size();
+        }
+        // PPMの検証結果を表示
+        void report(std::string_view head) const {
+            if(!this->is_ppm){
+                std::cout << head << "output (" << this->size() << " bytes) written in " << this->path << std::endl;
+            }else if(this->state == Ppm_state::error){
+                std::cout << head_warning << "output image " << this->path << " is invalid: " << this->error_message << " (at byte " << this->error_at << ")" << std::endl;
+            }else if(this->state != Ppm_state::done){
+                std::cout << head_warning << "output image " << this->path << " is incomplete (" << this->sample_num / 3 << " of " << this->sample_expected / 3 << " pixels)" << std::endl;
+            }else{
+                std::cout << head << "output image written in " << this->path << " (P" << (this->is_binary ? 6 : 3) << ", " << this->header_fields[0] << "x" << this->header_fields[1] << ")" << std::endl;
+            }
+        }
+};
+
+extern Output_sink output_sink;
+extern TransmissionQueue send_buffer;
+
+// stdの出力 (シンクが開かれていればそこへ直接書き、そうでなければ送信バッファに積む)
+inline void output_std(Bit32 v){
+    if(output_sink.is_open()){
+        output_sink.put(static_cast<unsigned char>(v.i)); // 下8bitだけ書き込む
+    }else{
+        send_buffer.push(v);
+    }
+}
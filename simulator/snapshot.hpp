@@ -0,0 +1,60 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <sim.hpp>
+#include <vector>
+#include <algorithm>
+
+/* シミュレーションの状態のスナップショット */
+// 読み込み直後に取得しておき、initではファイルを読み直したり領域を確保し直したりせずにこれを書き戻す (逆実行のチェックポイントにも使う)
+class Snapshot{
+    private:
+        bool is_captured = false;
+        unsigned long long count = 0; // 取得した時点の実行命令数
+        unsigned long long op_type_count[op_type_num];
+        unsigned int pc = 0;
+        Reg reg_int;
+        Reg reg_fp;
+        Memory_snapshot memory;
+        Cache cache;
+        Gshare branch_predictor{gshare_width};
+        std::vector<Operation> op_list; // siで書き換えられている可能性がある
+        #ifndef EXTENDED
+        TransmissionQueue receive_buffer; // sim+では受信スレッド・送信スレッドが触るので対象外
+        TransmissionQueue send_buffer;
+        #endif
+    public:
+        unsigned long long op_count() const { return this->count; }
+        void capture(){
+            this->count = ::op_count();
+            std::copy(::op_type_count, ::op_type_count + op_type_num, this->op_type_count);
+            this->pc = ::pc;
+            this->reg_int = ::reg_int;
+            this->reg_fp = ::reg_fp;
+            this->memory.capture(::memory);
+            if(!this->is_captured) this->cache = Cache(::cache.index_width, ::cache.offset_width, ::cache.way_num); // 領域の確保は最初の1回のみ
+            this->cache.copy_from(::cache);
+            this->branch_predictor.copy_from(::branch_predictor);
+            this->op_list = ::op_list;
+            #ifndef EXTENDED
+            this->receive_buffer = ::receive_buffer;
+            this->send_buffer = ::send_buffer;
+            #endif
+            this->is_captured = true;
+        }
+        void restore() const {
+            std::copy(this->op_type_count, this->op_type_count + op_type_num, ::op_type_count);
+            ::pc = this->pc;
+            ::reg_int = this->reg_int;
+            ::reg_fp = this->reg_fp;
+            this->memory.restore(::memory);
+            ::cache.copy_from(this->cache);
+            ::branch_predictor.copy_from(this->branch_predictor);
+            ::op_list = this->op_list;
+            #ifndef EXTENDED
+            ::receive_buffer = this->receive_buffer;
+            ::send_buffer = this->send_buffer;
+            #endif
+        }
+};
@@ -0,0 +1,88 @@
+#pragma once
+#include <string>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+/* sim+とserverの間の通信に使うソケット */
+// ポート番号Nに対して、TCPのループバック(127.0.0.1:N)か、Unixドメインソケット(unix_socket_path(N))のどちらかを使う
+// Unixドメインソケットではカーネル内のTCPの処理(Nagleのアルゴリズムや遅延ACKなど)を経由しない
+
+// ポート番号に対応するUnixドメインソケットのパス
+inline std::string unix_socket_path(int port){
+    return "/tmp/cpuex2021-4_simulator_" + std::to_string(port) + ".sock";
+}
+
+// 小さなデータ(受信確認など)がすぐに送られるようにする
+inline void set_nodelay(int socket, bool is_unix){
+    if(!is_unix){
+        int opt = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+}
+
+// 待ち受け用のソケットを作る (失敗した場合は-1)
+inline int listen_on(int port, bool is_unix, int backlog){
+    int server_socket;
+    int res;
+    if(is_unix){
+        struct sockaddr_un server_addr = {};
+        server_addr.sun_family = AF_UNIX;
+        std::string path = unix_socket_path(port);
+        std::strncpy(server_addr.sun_path, path.c_str(), sizeof(server_addr.sun_path) - 1);
+        unlink(path.c_str()); // 前回の実行で残ったものを削除
+        server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        res = bind(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr));
+    }else{
+        struct sockaddr_in server_addr = {};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        int opt = 1;
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        res = bind(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr));
+    }
+    if(res != 0 || listen(server_socket, backlog) != 0){
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+// 接続を受け付ける
+inline int accept_from(int server_socket, bool is_unix){
+    int client_socket = accept(server_socket, nullptr, nullptr);
+    if(client_socket >= 0) set_nodelay(client_socket, is_unix);
+    return client_socket;
+}
+
+// ローカルの相手に接続する (失敗した場合は-1)
+inline int connect_to(int port, bool is_unix){
+    int client_socket;
+    int res;
+    if(is_unix){
+        struct sockaddr_un opponent_addr = {};
+        opponent_addr.sun_family = AF_UNIX;
+        std::strncpy(opponent_addr.sun_path, unix_socket_path(port).c_str(), sizeof(opponent_addr.sun_path) - 1);
+        client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        res = connect(client_socket, (struct sockaddr *) &opponent_addr, sizeof(opponent_addr));
+    }else{
+        struct sockaddr_in opponent_addr = {};
+        opponent_addr.sin_family = AF_INET;
+        opponent_addr.sin_port = htons(port);
+        inet_aton("127.0.0.1", &opponent_addr.sin_addr);
+        client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        res = connect(client_socket, (struct sockaddr *) &opponent_addr, sizeof(opponent_addr));
+    }
+    if(res != 0){
+        close(client_socket);
+        return -1;
+    }
+    set_nodelay(client_socket, is_unix);
+    return client_socket;
+}
@@ -0,0 +1,362 @@
+#pragma once
+#include <params.hpp>
+#include <common.hpp>
+#include <unit.hpp>
+#include <fpu.hpp>
+#include <sim.hpp>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <exception>
+
+/*
+    direct-threaded方式の実行エンジン
+    - op_listを「ハンドラ(ラベル)のアドレス + オペランド」の列に予めデコードしておき、
+      各ハンドラの末尾から次の命令のハンドラへ直接goto(computed goto)する
+    - 分岐先アドレスやjal/jalrの戻り先アドレスはデコード時に計算しておく
+    - 実行結果(レジスタ・メモリ・送受信バッファ・命令数のカウント)はexec_opと完全に一致する
+*/
+
+/* 予めデコードされた命令 */
+struct Threaded_op{
+    const void* handler; // 命令を処理するラベルのアドレス
+    unsigned int rd;
+    unsigned int rs1;
+    unsigned int rs2;
+    int imm;
+    unsigned int target; // 分岐命令の飛び先 (jal/jalrでは戻り先のアドレスpc+1)
+};
+
+std::vector<Threaded_op> threaded_ops; // デコード済みの命令列 (末尾に番兵を1つ持つ)
+
+// 終了状態になるまでdirect-threaded方式で実行
+int exec_threaded(){
+    // 命令の種類ごとのハンドラ (Otypeの順)
+    static const void* const handler_table[op_type_num + 1] = {
+        &&h_add, &&h_sub, &&h_sll, &&h_srl, &&h_sra, &&h_and,
+        &&h_fabs, &&h_fneg, &&h_fdiv, &&h_fsqrt, &&h_fcvtif, &&h_fcvtfi, &&h_fmvff,
+        &&h_fadd, &&h_fsub, &&h_fmul,
+        &&h_beq, &&h_blt,
+        &&h_fbeq, &&h_fblt,
+        &&h_sw, &&h_si, &&h_std,
+        &&h_fsw,
+        &&h_addi, &&h_slli, &&h_srli, &&h_srai, &&h_andi,
+        &&h_lw, &&h_lre, &&h_lrd, &&h_ltf,
+        &&h_flw,
+        &&h_jalr,
+        &&h_jal,
+        &&h_lui,
+        &&h_fmvif,
+        &&h_fmvfi,
+        &&h_invalid // o_nop
+    };
+    // IEEE754モード用 (浮動小数演算のみ異なる)
+    static const void* const handler_table_ieee[op_type_num + 1] = {
+        &&h_add, &&h_sub, &&h_sll, &&h_srl, &&h_sra, &&h_and,
+        &&h_fabs_ieee, &&h_fneg_ieee, &&h_fdiv_ieee, &&h_fsqrt_ieee, &&h_fcvtif_ieee, &&h_fcvtfi_ieee, &&h_fmvff,
+        &&h_fadd_ieee, &&h_fsub_ieee, &&h_fmul_ieee,
+        &&h_beq, &&h_blt,
+        &&h_fbeq, &&h_fblt,
+        &&h_sw, &&h_si, &&h_std,
+        &&h_fsw,
+        &&h_addi, &&h_slli, &&h_srli, &&h_srai, &&h_andi,
+        &&h_lw, &&h_lre, &&h_lrd, &&h_ltf,
+        &&h_flw,
+        &&h_jalr,
+        &&h_jal,
+        &&h_lui,
+        &&h_fmvif,
+        &&h_fmvfi,
+        &&h_invalid // o_nop
+    };
+    static const void* const handler_exit = &&h_exit; // jal x0, 0
+    const void* const* table = is_ieee ? handler_table_ieee : handler_table;
+
+    // 命令1つ分のデコード
+    auto decode = [&](unsigned int id, const Operation& op){
+        Threaded_op& t = threaded_ops[id];
+        t.handler = table[op.type];
+        t.rd = op.rd;
+        t.rs1 = op.rs1;
+        t.rs2 = op.rs2;
+        t.imm = op.imm;
+        if(op.is_conditional() || op.is_jal()){
+            t.target = id + op.imm;
+        }else{
+            t.target = id + 1;
+        }
+        if(op.is_exit()) t.handler = handler_exit;
+    };
+
+    // op_listの全体をデコード (debugモードのdo/continueでsiが実行されている可能性があるので毎回行う)
+    threaded_ops.resize(code_size + 1);
+    for(unsigned int id=0; id<code_size; ++id) decode(id, op_list[id]);
+    threaded_ops[code_size].handler = &&h_end; // 番兵: 末尾まで実行した場合
+
+    Threaded_op* const base = threaded_ops.data();
+    Threaded_op* op = base + pc;
+    unsigned int end_pc = 0; // 範囲外に分岐した場合の飛び先
+
+    if(pc >= code_size) return sim_state_end;
+    goto *op->handler;
+
+    h_add:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) + reg_int.read_int(op->rs2));
+        ++op_type_count[o_add];
+        goto *(++op)->handler;
+    h_sub:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) - reg_int.read_int(op->rs2));
+        ++op_type_count[o_sub];
+        goto *(++op)->handler;
+    h_sll:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) << reg_int.read_int(op->rs2));
+        ++op_type_count[o_sll];
+        goto *(++op)->handler;
+    h_srl:
+        reg_int.write_int(op->rd, static_cast<unsigned int>(reg_int.read_int(op->rs1)) >> reg_int.read_int(op->rs2));
+        ++op_type_count[o_srl];
+        goto *(++op)->handler;
+    h_sra:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) >> reg_int.read_int(op->rs2)); // note: 処理系依存
+        ++op_type_count[o_sra];
+        goto *(++op)->handler;
+    h_and:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) & reg_int.read_int(op->rs2));
+        ++op_type_count[o_and];
+        goto *(++op)->handler;
+    h_fabs:
+        reg_fp.write_32(op->rd, fpu.fabs(reg_fp.read_32(op->rs1)));
+        ++op_type_count[o_fabs];
+        goto *(++op)->handler;
+    h_fabs_ieee:
+        reg_fp.write_float(op->rd, std::abs(reg_fp.read_float(op->rs1)));
+        ++op_type_count[o_fabs];
+        goto *(++op)->handler;
+    h_fneg:
+        reg_fp.write_32(op->rd, fpu.fneg(reg_fp.read_32(op->rs1)));
+        ++op_type_count[o_fneg];
+        goto *(++op)->handler;
+    h_fneg_ieee:
+        reg_fp.write_float(op->rd, - reg_fp.read_float(op->rs1));
+        ++op_type_count[o_fneg];
+        goto *(++op)->handler;
+    h_fdiv:
+        reg_fp.write_32(op->rd, fpu.fdiv(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+        ++op_type_count[o_fdiv];
+        goto *(++op)->handler;
+    h_fdiv_ieee:
+        reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) / reg_fp.read_float(op->rs2));
+        ++op_type_count[o_fdiv];
+        goto *(++op)->handler;
+    h_fsqrt:
+        reg_fp.write_32(op->rd, fpu.fsqrt(reg_fp.read_32(op->rs1)));
+        ++op_type_count[o_fsqrt];
+        goto *(++op)->handler;
+    h_fsqrt_ieee:
+        reg_fp.write_float(op->rd, std::sqrt(reg_fp.read_float(op->rs1)));
+        ++op_type_count[o_fsqrt];
+        goto *(++op)->handler;
+    h_fcvtif:
+        reg_fp.write_32(op->rd, fpu.itof(reg_fp.read_32(op->rs1)));
+        ++op_type_count[o_fcvtif];
+        goto *(++op)->handler;
+    h_fcvtif_ieee:
+        reg_fp.write_float(op->rd, static_cast<float>(reg_fp.read_int(op->rs1)));
+        ++op_type_count[o_fcvtif];
+        goto *(++op)->handler;
+    h_fcvtfi:
+        reg_fp.write_32(op->rd, fpu.ftoi(reg_fp.read_32(op->rs1)));
+        ++op_type_count[o_fcvtfi];
+        goto *(++op)->handler;
+    h_fcvtfi_ieee:
+        reg_fp.write_float(op->rd, static_cast<int>(std::nearbyint(reg_fp.read_float(op->rs1))));
+        ++op_type_count[o_fcvtfi];
+        goto *(++op)->handler;
+    h_fmvff:
+        reg_fp.write_32(op->rd, reg_fp.read_32(op->rs1));
+        ++op_type_count[o_fmvff];
+        goto *(++op)->handler;
+    h_fadd:
+        reg_fp.write_32(op->rd, fpu.fadd(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+        ++op_type_count[o_fadd];
+        goto *(++op)->handler;
+    h_fadd_ieee:
+        reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) + reg_fp.read_float(op->rs2));
+        ++op_type_count[o_fadd];
+        goto *(++op)->handler;
+    h_fsub:
+        reg_fp.write_32(op->rd, fpu.fsub(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+        ++op_type_count[o_fsub];
+        goto *(++op)->handler;
+    h_fsub_ieee:
+        reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) - reg_fp.read_float(op->rs2));
+        ++op_type_count[o_fsub];
+        goto *(++op)->handler;
+    h_fmul:
+        reg_fp.write_32(op->rd, fpu.fmul(reg_fp.read_32(op->rs1), reg_fp.read_32(op->rs2)));
+        ++op_type_count[o_fmul];
+        goto *(++op)->handler;
+    h_fmul_ieee:
+        reg_fp.write_float(op->rd, reg_fp.read_float(op->rs1) * reg_fp.read_float(op->rs2));
+        ++op_type_count[o_fmul];
+        goto *(++op)->handler;
+    h_beq:
+        {
+            bool taken = reg_int.read_int(op->rs1) == reg_int.read_int(op->rs2);
+            unsigned int next_pc = taken ? op->target : static_cast<unsigned int>(op - base) + 1;
+            ++op_type_count[o_beq];
+            #ifdef EXTENDED
+            if(is_gshare_enabled) branch_predictor.update(next_pc, taken);
+            #endif
+            if(next_pc >= code_size){ end_pc = next_pc; goto h_out_of_range; }
+            op = base + next_pc;
+        }
+        goto *op->handler;
+    h_blt:
+        {
+            bool taken = reg_int.read_int(op->rs1) < reg_int.read_int(op->rs2);
+            unsigned int next_pc = taken ? op->target : static_cast<unsigned int>(op - base) + 1;
+            ++op_type_count[o_blt];
+            #ifdef EXTENDED
+            if(is_gshare_enabled) branch_predictor.update(next_pc, taken);
+            #endif
+            if(next_pc >= code_size){ end_pc = next_pc; goto h_out_of_range; }
+            op = base + next_pc;
+        }
+        goto *op->handler;
+    h_fbeq:
+        {
+            bool taken = reg_fp.read_float(op->rs1) == reg_fp.read_float(op->rs2);
+            unsigned int next_pc = taken ? op->target : static_cast<unsigned int>(op - base) + 1;
+            ++op_type_count[o_fbeq];
+            #ifdef EXTENDED
+            if(is_gshare_enabled) branch_predictor.update(next_pc, taken);
+            #endif
+            if(next_pc >= code_size){ end_pc = next_pc; goto h_out_of_range; }
+            op = base + next_pc;
+        }
+        goto *op->handler;
+    h_fblt:
+        {
+            bool taken = reg_fp.read_float(op->rs1) < reg_fp.read_float(op->rs2);
+            unsigned int next_pc = taken ? op->target : static_cast<unsigned int>(op - base) + 1;
+            ++op_type_count[o_fblt];
+            #ifdef EXTENDED
+            if(is_gshare_enabled) branch_predictor.update(next_pc, taken);
+            #endif
+            if(next_pc >= code_size){ end_pc = next_pc; goto h_out_of_range; }
+            op = base + next_pc;
+        }
+        goto *op->handler;
+    h_sw:
+        pc = op - base; // 例外が投げられた場合に備える
+        write_memory(reg_int.read_int(op->rs1) + op->imm, reg_int.read_32(op->rs2));
+        ++op_type_count[o_sw];
+        goto *(++op)->handler;
+    h_si:
+        {
+            unsigned int id = reg_int.read_int(op->rs1) + op->imm;
+            op_list[id] = Operation(reg_int.read_int(op->rs2));
+            if(id < code_size) decode(id, op_list[id]); // 書き換えられた命令をデコードし直す
+            ++op_type_count[o_si];
+        }
+        goto *(++op)->handler;
+    h_std:
+        output_std(reg_int.read_int(op->rs2));
+        ++op_type_count[o_std];
+        goto *(++op)->handler;
+    h_fsw:
+        pc = op - base;
+        write_memory(reg_int.read_int(op->rs1) + op->imm, reg_fp.read_32(op->rs2));
+        ++op_type_count[o_fsw];
+        goto *(++op)->handler;
+    h_addi:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) + op->imm);
+        ++op_type_count[o_addi];
+        goto *(++op)->handler;
+    h_slli:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) << op->imm);
+        ++op_type_count[o_slli];
+        goto *(++op)->handler;
+    h_srli:
+        reg_int.write_int(op->rd, static_cast<unsigned int>(reg_int.read_int(op->rs1)) >> op->imm);
+        ++op_type_count[o_srli];
+        goto *(++op)->handler;
+    h_srai:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) >> op->imm); // todo: 処理系依存
+        ++op_type_count[o_srai];
+        goto *(++op)->handler;
+    h_andi:
+        reg_int.write_int(op->rd, reg_int.read_int(op->rs1) & op->imm);
+        ++op_type_count[o_andi];
+        goto *(++op)->handler;
+    h_lw:
+        pc = op - base;
+        reg_int.write_32(op->rd, read_memory(reg_int.read_int(op->rs1) + op->imm));
+        ++op_type_count[o_lw];
+        goto *(++op)->handler;
+    h_lre:
+        reg_int.write_int(op->rd, receive_buffer.empty() ? 1 : 0);
+        ++op_type_count[o_lre];
+        goto *(++op)->handler;
+    h_lrd:
+        if(!receive_buffer.empty()){
+            reg_int.write_32(op->rd, receive_buffer.pop());
+        }else{
+            pc = op - base;
+            throw std::runtime_error("receive buffer is empty [lrd] (at pc " + std::to_string(pc) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(pc))) : "") + ")");
+        }
+        ++op_type_count[o_lrd];
+        goto *(++op)->handler;
+    h_ltf:
+        reg_int.write_int(op->rd, 0); // 暫定的に、常にfull flagが立っていない(=送信バッファの大きさに制限がない)としている
+        ++op_type_count[o_ltf];
+        goto *(++op)->handler;
+    h_flw:
+        pc = op - base;
+        reg_fp.write_32(op->rd, read_memory(reg_int.read_int(op->rs1) + op->imm));
+        ++op_type_count[o_flw];
+        goto *(++op)->handler;
+    h_jalr:
+        {
+            unsigned int next_pc = reg_int.read_int(op->rs1);
+            reg_int.write_int(op->rd, op - base + 1);
+            ++op_type_count[o_jalr];
+            if(next_pc >= code_size){ end_pc = next_pc; goto h_out_of_range; }
+            op = base + next_pc;
+        }
+        goto *op->handler;
+    h_jal:
+        reg_int.write_int(op->rd, op - base + 1);
+        ++op_type_count[o_jal];
+        if(op->target >= code_size){ end_pc = op->target; goto h_out_of_range; }
+        op = base + op->target;
+        goto *op->handler;
+    h_lui:
+        reg_int.write_int(op->rd, op->imm << 12);
+        ++op_type_count[o_lui];
+        goto *(++op)->handler;
+    h_fmvif:
+        reg_fp.write_32(op->rd, reg_int.read_32(op->rs1));
+        ++op_type_count[o_fmvif];
+        goto *(++op)->handler;
+    h_fmvfi:
+        reg_int.write_32(op->rd, reg_fp.read_32(op->rs1));
+        ++op_type_count[o_fmvfi];
+        goto *(++op)->handler;
+
+    // 終了処理
+    h_exit: // jal x0, 0
+        ++op_type_count[o_jal];
+        pc = op - base;
+        return sim_state_end;
+    h_end: // 末尾まで実行した
+        pc = op - base;
+        return sim_state_end;
+    h_out_of_range: // 範囲外に分岐した
+        pc = end_pc;
+        return sim_state_end;
+    h_invalid:
+        pc = op - base;
+        throw std::runtime_error("error in executing the code (at pc " + std::to_string(pc) + (is_debug ? (", line " + std::to_string(id_to_line.left.at(pc))) : "") + ")");
+}
@@ -5,135 +5,245 @@
 #include <sim.hpp>
 #include <string>
 #include <iostream>
+#include <socket.hpp>
 #include <sys/socket.h>
-#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <pthread.h>
 
 
+// 受信側の接続ごとの状態
+struct Receive_session{
+    int socket;
+    enum class Framing{ unknown, text, raw } framing = Framing::unknown; // 接続の先頭1バイトで判定
+    char text[32]; // テキスト形式: 32文字揃うまでの途中の文字列
+    unsigned int text_len = 0;
+    unsigned int header_len = 0; // バイナリ形式: 読み込み途中の長さヘッダのバイト数
+    unsigned int frame_len = 0;
+    unsigned int remaining = 0; // バイナリ形式: 現在のフレームの残りのバイト数
+    Receive_session(int socket) : socket(socket) {}
+};
+
+// 受信したバイト列を解釈して受信バッファに追加
+inline void consume_received(Receive_session& s, const unsigned char* buf, std::size_t size){
+    std::size_t i = 0;
+    while(i < size){
+        switch(s.framing){
+            case Receive_session::Framing::unknown:
+                if(buf[i] == protocol_raw_tag){
+                    s.framing = Receive_session::Framing::raw;
+                    ++i;
+                }else{
+                    s.framing = Receive_session::Framing::text;
+                }
+                break;
+            case Receive_session::Framing::text: // "0"/"1"の32文字を、big endianの4バイトとして追加
+                s.text[s.text_len++] = buf[i++];
+                if(s.text_len == 32){
+                    unsigned char bytes[4] = {};
+                    for(int j=0; j<32; ++j) bytes[j / 8] = (bytes[j / 8] << 1) | (s.text[j] == '1' ? 1 : 0);
+                    receive_buffer.push(bytes, 4);
+                    s.text_len = 0;
+                }
+                break;
+            case Receive_session::Framing::raw: // 4バイトの長さ(big endian)に続くバイト列
+                if(s.remaining == 0){
+                    s.frame_len = (s.frame_len << 8) | buf[i++];
+                    if(++s.header_len == 4){
+                        s.remaining = s.frame_len;
+                        s.header_len = 0;
+                        s.frame_len = 0;
+                    }
+                }else{
+                    std::size_t n = std::min<std::size_t>(s.remaining, size - i);
+                    receive_buffer.push(buf + i, n);
+                    s.remaining -= n;
+                    i += n;
+                }
+                break;
+        }
+    }
+}
+
 // データの受信
+// 接続は閉じられるまで保持し、複数の接続をpollでまとめて待つ
 void receive_data(){
-    // 受信設定
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    
     // 受信の準備
-    int server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    bind(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr));
-    listen(server_socket, 5);
+    int server_socket = listen_on(port, is_unix_socket, 5);
+    if(server_socket < 0){
+        std::cerr << head_error << "could not listen on " << (is_unix_socket ? unix_socket_path(port) : "port " + std::to_string(port)) << std::endl;
+        return;
+    }
 
-    // クライアントの情報を保持する変数など
-    struct sockaddr_in client_addr;
-    int client_socket;
-    int client_addr_size = sizeof(client_addr);
-    char buf[32];
-    // int recv_len;
+    std::vector<struct pollfd> fds = {{server_socket, POLLIN, 0}}; // 先頭は待ち受け用のソケット
+    std::vector<Receive_session> sessions; // fds[i+1]に対応
+    std::vector<unsigned char> buf(receive_chunk_size);
 
     while(true){
-        client_socket = accept(server_socket, (struct sockaddr *) &client_addr, (socklen_t *) &client_addr_size);
-        recv(client_socket, buf, 32, 0);
-        std::string data(buf);
-        memset(buf, '\0', sizeof(buf)); // バッファをクリア
-        for(int i=0; i<4; ++i){ // big endianで受信したものとしてバッファに追加
-            receive_buffer.push(bit32_of_data(data.substr(i * 8, 8)));
+        if(poll(fds.data(), fds.size(), -1) < 0) continue;
+
+        // 受信済みの接続からの読み込み
+        for(std::size_t i=1; i<fds.size();){
+            if(fds[i].revents == 0){
+                ++i;
+                continue;
+            }
+            ssize_t recv_len = recv(fds[i].fd, buf.data(), buf.size(), 0);
+            if(recv_len > 0){
+                consume_received(sessions[i-1], buf.data(), recv_len);
+                ++i;
+            }else{ // 切断された場合
+                close(fds[i].fd);
+                fds.erase(fds.begin() + i);
+                sessions.erase(sessions.begin() + (i-1));
+            }
         }
 
-        // while((recv_len = recv(client_socket, buf, 64, 0)) != 0){
-        //     send(client_socket, "0", 1, 0); // 成功したらループバック
-
-        //     // 受信したデータの処理
-        //     std::string data(buf);
-        //     memset(buf, '\0', sizeof(buf)); // バッファをクリア
-        //     // if(is_debug){
-        //     //     std::cout << head_data << "received " << data << std::endl;
-        //     //     if(!loop_flag){
-        //     //         std::cout << "\033[2D# " << std::flush;
-        //     //     }
-        //     // }
-
-        //     if(is_bootloading && data[0] == 'n'){
-        //         filename = "boot-" + data.substr(1);
-        //         if(is_debug){
-        //             std::cout << head_info << "loading ./code/" << data.substr(1) << std::endl;
-        //             std::cout << "\033[2D# " << std::flush;
-        //         }
-        //     }else if(is_loading_codes && data[0] == 't'){ // 渡されてきたラベル・ブレークポイントを処理
-        //         // 命令ロード中の場合
-        //         if(is_debug){
-        //             std::string text = data.substr(1);
-        //             std::smatch match;
-        //             if(std::regex_match(text, match, std::regex("^@(-?\\d+)$"))){
-        //                 id_to_line_loaded.insert(bimap_value_t2(loading_id, std::stoi(match[1].str())));
-        //             }else if(std::regex_match(text, match, std::regex("^@(-?\\d+)#(([a-zA-Z_]\\w*(.\\d+)*))$"))){ // ラベルのみ
-        //                 id_to_line_loaded.insert(bimap_value_t2(loading_id, std::stoi(match[1].str())));
-        //                 label_to_id_loaded.insert(bimap_value_t(match[2].str(), loading_id));             
-        //             }else if(std::regex_match(text, match, std::regex("^@(-?\\d+)!(([a-zA-Z_]\\w*(.\\d+)*))$"))){ // ブレークポイントのみ
-        //                 id_to_line_loaded.insert(bimap_value_t2(loading_id, std::stoi(match[1].str())));
-        //                 bp_to_id_loaded.insert(bimap_value_t(match[2].str(), loading_id));
-        //             }else if(std::regex_match(text, match, std::regex("^@(-?\\d+)#(([a-zA-Z_]\\w*(.\\d+)*))!(([a-zA-Z_]\\w*(.\\d+)*))$"))){ // ラベルとブレークポイントの両方
-        //                 id_to_line_loaded.insert(bimap_value_t2(loading_id, std::stoi(match[1].str())));
-        //                 label_to_id_loaded.insert(bimap_value_t(match[2].str(), loading_id));
-        //                 bp_to_id_loaded.insert(bimap_value_t(match[3].str(), loading_id));
-        //             }else{
-        //                 std::cerr << head_error << "could not parse the received code" << std::endl;
-        //                 std::exit(EXIT_FAILURE);
-        //             }
-
-        //             ++loading_id;
-        //         }else{
-        //             std::cerr << head_error << "invalid data received (maybe: put -d option to ./server)" << std::endl;
-        //             std::exit(EXIT_FAILURE);
-        //         }
-        //     }else{
-        //         receive_buffer.push(bit32_of_data(data));
-        //     }
-        // }
-        // close(client_socket);
+        // 新しい接続
+        if(fds[0].revents & POLLIN){
+            int client_socket = accept_from(server_socket, is_unix_socket);
+            if(client_socket >= 0){
+                fds.push_back({client_socket, POLLIN, 0});
+                sessions.emplace_back(client_socket);
+            }
+        }
     }
     return;
 }
 
+// 時計(スレッドごとのCPU時間など)の現在値を秒単位で返す
+inline double cpu_time_of(clockid_t clock){
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) * 1e-9;
+}
+
+// 全体を送り切るまでsendを繰り返す
+inline bool send_all(int socket, const unsigned char* data, std::size_t size){
+    while(size > 0){
+        ssize_t res = send(socket, data, size, MSG_NOSIGNAL);
+        if(res <= 0) return false;
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+// 接続直後のネゴシエーション
+// サーバから挨拶 (protocol_raw_tag, protocol_version) が届けばバイナリ形式を選び、届かなければ従来の形式を使う
+// バイナリ形式を選ぶ場合は、protocol_raw_tagに続けてセッションID (受信用のポート番号, big endian 4バイト) を返す
+inline bool negotiate_raw(int socket){
+    unsigned char greeting[2];
+    unsigned int len = 0;
+    struct pollfd pfd = {socket, POLLIN, 0};
+    while(len < 2){
+        if(poll(&pfd, 1, protocol_negotiation_timeout) <= 0) return false;
+        ssize_t res = recv(socket, greeting + len, 2 - len, 0);
+        if(res <= 0) return false;
+        len += res;
+    }
+    if(greeting[0] != protocol_raw_tag || greeting[1] != protocol_version) return false;
+    unsigned char reply[5] = {protocol_raw_tag};
+    for(int i=0; i<4; ++i) reply[i + 1] = static_cast<unsigned char>(port >> (24 - i * 8));
+    return send_all(socket, reply, 5);
+}
+
+// 受信確認 (サーバが受け取ったバイト数の累計をbig endianの4バイトで表したもの) の読み込み
+struct Ack_reader{
+    unsigned int acked = 0;
+    unsigned char buf[4];
+    unsigned int len = 0;
+    bool read(int socket, bool is_blocking){ // 切断されていればfalse
+        unsigned char tmp[64];
+        ssize_t res = recv(socket, tmp, sizeof(tmp), is_blocking ? 0 : MSG_DONTWAIT);
+        if(res == 0) return false;
+        if(res < 0) return !is_blocking && (errno == EAGAIN || errno == EWOULDBLOCK);
+        for(ssize_t i=0; i<res; ++i){
+            this->buf[this->len++] = tmp[i];
+            if(this->len == 4){
+                this->acked = (this->buf[0] << 24) | (this->buf[1] << 16) | (this->buf[2] << 8) | this->buf[3];
+                this->len = 0;
+            }
+        }
+        return true;
+    }
+};
+
 // データの送信
+// バイナリ形式では、受信確認を待たずに送ってよいバイト数をprotocol_windowまでとし、溜まっている分をまとめて1フレームで送る
 void send_data(Cancel_flag& flg){
     if(!is_raytracing){
-        // データ送信の準備
-        struct in_addr host_addr;
-        inet_aton("127.0.0.1", &host_addr);
-        struct sockaddr_in opponent_addr; // 通信相手(./server)の情報
-        opponent_addr.sin_family = AF_INET;
-        opponent_addr.sin_port = htons(port+1);
-        opponent_addr.sin_addr = host_addr;
-
         int client_socket = 0; // 送信用のソケット
         bool is_connected = false; // 通信が維持されているかどうかのフラグ
-        Bit32 b32;
+        bool is_raw = false; // バイナリ形式で送信しているかどうか
+        unsigned int sent = 0; // バイナリ形式で送信したバイト数の累計
+        Ack_reader ack;
+        std::vector<unsigned char> frame(4 + protocol_window);
         std::string data;
-        int res;
         char recv_buf[1];
         int res_len;
 
+        // 通信の切断時の処理
+        auto disconnect = [&](){
+            std::cout << head_error << "data transmission failed (restart both ./sim and ./server)" << std::endl;
+            close(client_socket);
+            is_connected = false;
+        };
+
         while(!flg){
+            // データが溜まるか終了が通知されるまで眠る
+            send_buffer.wait(is_connected && is_raw ? send_batch_threshold : 1, std::chrono::milliseconds(send_flush_interval), [&flg]{ return flg.is_signaled(); });
             while(!send_buffer.empty()){
                 if(!is_connected){ // 接続されていない場合
-                    client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-                    res = connect(client_socket, (struct sockaddr *) &opponent_addr, sizeof(opponent_addr));
-                    if(res == 0){
+                    client_socket = connect_to(port + 1, is_unix_socket); // 通信相手は./server
+                    if(client_socket >= 0){
                         is_connected = true;
+                        is_raw = negotiate_raw(client_socket);
+                        sent = 0;
+                        ack = Ack_reader();
                     }else{
                         std::cout << head_error << "connection failed (check whether ./server has been started)" << std::endl;
+                        send_buffer.pop(); // 送れなかったデータは捨てる
+                        continue;
                     }
                 }
-                
-                data = binary_of_int(send_buffer.pop().i);
-                send(client_socket, data.substr(24, 8).c_str(), 8, 0); // 下8bitだけ送信
-                res_len = recv(client_socket, recv_buf, 1, 0);
-                if(res_len == 0 || recv_buf[0] != '0'){ // 通信が切断された場合
-                    std::cout << head_error << "data transmission failed (restart both ./sim and ./server)" << std::endl;
-                    is_connected = false;
+
+                if(is_raw){
+                    std::size_t n = 0;
+                    while(sent + n - ack.acked < protocol_window && !send_buffer.empty()){
+                        frame[4 + n++] = static_cast<unsigned char>(send_buffer.pop().i); // 下8bitだけ送信
+                    }
+                    if(n > 0){
+                        for(int i=0; i<4; ++i) frame[i] = static_cast<unsigned char>(n >> (24 - i * 8));
+                        if(!send_all(client_socket, frame.data(), 4 + n)){
+                            disconnect();
+                            continue;
+                        }
+                        sent += n;
+                    }
+                    if(!ack.read(client_socket, sent - ack.acked >= protocol_window)) disconnect(); // 窓が埋まっていれば受信確認を待つ
+                }else{
+                    data = binary_of_int(send_buffer.pop().i);
+                    send(client_socket, data.substr(24, 8).c_str(), 8, MSG_NOSIGNAL); // 下8bitだけ送信
+                    res_len = recv(client_socket, recv_buf, 1, 0);
+                    if(res_len <= 0 || recv_buf[0] != '0'){ // 通信が切断された場合
+                        disconnect();
+                    }
                 }
             }
         }
-        close(client_socket);
+
+        // 送信済みのデータがサーバに届くまで待つ
+        while(is_connected && is_raw && ack.acked != sent){
+            if(!ack.read(client_socket, true)) disconnect();
+        }
+        if(is_connected) close(client_socket);
     }
+    io_cpu_time_send = cpu_time_of(CLOCK_THREAD_CPUTIME_ID);
     return;
 }
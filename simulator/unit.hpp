@@ -2,10 +2,19 @@
 #include <params.hpp>
 #include <common.hpp>
 #include <iostream>
-#include <queue>
+#include <atomic>
+#ifdef EXTENDED
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#endif
+#include <cstddef>
+#include <cstdint>
 #include <vector>
+#include <string>
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #ifdef DETAILED
 #include <sim.hpp>
 #endif
@@ -34,6 +43,7 @@ class Reg{
         constexpr void write_float(unsigned int i, float v){
             if(i != 0) this->data[i] = Bit32(v);
         }
+        constexpr Bit32* data_ptr(){ return this->data; } // JIT用
         void print(bool is_int, Stype t){
             std::string reg_type = is_int ? "x" : "f";
             for(unsigned int i=0; i<reg_size; ++i){
@@ -45,26 +55,125 @@ class Reg{
 
 
 /* キャッシュ */
+// セットアソシアティブ (way_num = 1 ならダイレクトマップ)
+// ミスするごとに、およびdirtyなブロックを追い出すごとにcycles_when_missedだけストールするものとして数える
+// (ライトスルーの書き込みはバッファされるものとしてストールしない)
+enum class Replacement{
+    lru,
+    fifo,
+    random
+};
+inline std::string string_of_replacement(Replacement r){
+    switch(r){
+        case Replacement::lru: return "LRU";
+        case Replacement::fifo: return "FIFO";
+        default: return "random";
+    }
+}
 class Cache{
     private:
-        unsigned int* tags;
+        struct Line{
+            unsigned int tag;
+            bool is_valid;
+            bool is_dirty;
+            unsigned long long time; // 最後にアクセスした時刻 (FIFOの場合は載せた時刻)
+        };
+        Line* lines; // セットごとにway_num個
+        unsigned long long time = 0;
+        unsigned int random_state = 2463534242u; // xorshift
+        constexpr Line* find(unsigned int, unsigned int);
+        constexpr Line* fill(unsigned int, unsigned int);
     public:
         unsigned int index_width;
         unsigned int offset_width;
-        unsigned long long accessed_times;
-        unsigned long long hit_times;
-        unsigned long long miss_times;
-        constexpr Cache(){ this->tags = {}; } // 宣言するとき用
-        constexpr Cache(unsigned int index_width, unsigned int offset_width){
-            this->tags = (unsigned int*) calloc(1 << index_width, sizeof(unsigned int));
+        unsigned int way_num = 1;
+        Replacement replacement = Replacement::lru;
+        bool is_write_back = true; // falseならライトスルー
+        bool is_write_allocate = true; // 書き込みでミスした場合にブロックを載せるか
+        unsigned long long accessed_times = 0;
+        unsigned long long hit_times = 0;
+        unsigned long long miss_times = 0;
+        unsigned long long read_miss_times = 0;
+        unsigned long long write_miss_times = 0;
+        unsigned long long writeback_times = 0; // dirtyなブロックの書き戻し
+        unsigned long long write_through_times = 0; // メモリへの直接の書き込み
+        unsigned long long stall_cycles = 0; // ミスによるストールの合計
+        constexpr Cache(){ this->lines = {}; } // 宣言するとき用
+        constexpr Cache(unsigned int index_width, unsigned int offset_width, unsigned int way_num = cache_way_num, Replacement replacement = Replacement::lru, bool is_write_back = true, bool is_write_allocate = true){
+            this->lines = (Line*) calloc((1 << index_width) * way_num, sizeof(Line));
             this->index_width = index_width;
             this->offset_width = offset_width;
+            this->way_num = way_num;
+            this->replacement = replacement;
+            this->is_write_back = is_write_back;
+            this->is_write_allocate = is_write_allocate;
         }
         constexpr unsigned int tag_width(){ return addr_width - (this->index_width + this->offset_width); }
+        void copy_from(const Cache& src){ // 同じ大きさのキャッシュの状態を複製 (スナップショット用)
+            std::memcpy(this->lines, src.lines, sizeof(Line) * (1 << this->index_width) * this->way_num);
+            this->time = src.time;
+            this->random_state = src.random_state;
+            this->replacement = src.replacement;
+            this->is_write_back = src.is_write_back;
+            this->is_write_allocate = src.is_write_allocate;
+            this->accessed_times = src.accessed_times;
+            this->hit_times = src.hit_times;
+            this->miss_times = src.miss_times;
+            this->read_miss_times = src.read_miss_times;
+            this->write_miss_times = src.write_miss_times;
+            this->writeback_times = src.writeback_times;
+            this->write_through_times = src.write_through_times;
+            this->stall_cycles = src.stall_cycles;
+        }
         constexpr void read(unsigned int);
         constexpr void write(unsigned int);
 };
 
+// セット内でタグが一致するブロックを探す (LRUの場合は時刻を更新する)
+inline constexpr Cache::Line* Cache::find(unsigned int index, unsigned int tag){
+    Line* set = this->lines + index * this->way_num;
+    for(unsigned int i=0; i<this->way_num; ++i){
+        if(set[i].is_valid && set[i].tag == tag){
+            if(this->replacement == Replacement::lru) set[i].time = ++this->time;
+            return set + i;
+        }
+    }
+    return nullptr;
+}
+
+// 追い出すブロックを選んで新しいブロックを載せる (dirtyなら書き戻す)
+inline constexpr Cache::Line* Cache::fill(unsigned int index, unsigned int tag){
+    Line* set = this->lines + index * this->way_num;
+    Line* victim = nullptr;
+    for(unsigned int i=0; i<this->way_num; ++i){ // 空いているものがあればそれを使う
+        if(!set[i].is_valid){
+            victim = set + i;
+            break;
+        }
+    }
+    if(victim == nullptr){
+        if(this->replacement == Replacement::random){
+            this->random_state ^= this->random_state << 13;
+            this->random_state ^= this->random_state >> 17;
+            this->random_state ^= this->random_state << 5;
+            victim = set + this->random_state % this->way_num;
+        }else{ // LRU, FIFOとも時刻が最も古いもの
+            victim = set;
+            for(unsigned int i=1; i<this->way_num; ++i){
+                if(set[i].time < victim->time) victim = set + i;
+            }
+        }
+        if(victim->is_dirty){
+            ++this->writeback_times;
+            this->stall_cycles += cycles_when_missed;
+        }
+    }
+    victim->tag = tag;
+    victim->is_valid = true;
+    victim->is_dirty = false;
+    victim->time = ++this->time;
+    return victim;
+}
 
 inline constexpr void Cache::read(unsigned int addr){
     ++this->accessed_times;
@@ -72,11 +181,13 @@ inline constexpr void Cache::read(unsigned int addr){
     unsigned int index = take_bits(addr, this->offset_width, this->offset_width + this->index_width - 1);
     unsigned int tag = take_bits(addr, this->offset_width + this->index_width, addr_width - 1);
 
-    if(this->tags[index] == tag){
+    if(this->find(index, tag) != nullptr){
         ++this->hit_times;
     }else{
-        this->tags[index] = tag;
         ++this->miss_times;
+        ++this->read_miss_times;
+        this->stall_cycles += cycles_when_missed;
+        this->fill(index, tag);
     }
 }
 
@@ -85,9 +196,23 @@ inline constexpr void Cache::write(unsigned int addr){
 
     unsigned int index = take_bits(addr, this->offset_width, this->offset_width + this->index_width - 1);
     unsigned int tag = take_bits(addr, this->offset_width + this->index_width, addr_width - 1);
-    
-    if(this->tags[index] == tag) ++this->hit_times;
-    this->tags[index] = tag;
+
+    Line* line = this->find(index, tag);
+    if(line != nullptr){
+        ++this->hit_times;
+    }else{
+        ++this->miss_times;
+        ++this->write_miss_times;
+        if(this->is_write_allocate){
+            this->stall_cycles += cycles_when_missed;
+            line = this->fill(index, tag);
+        }
+    }
+    if(line != nullptr && this->is_write_back){
+        line->is_dirty = true;
+    }else{
+        ++this->write_through_times;
+    }
 }
 
 
@@ -96,11 +221,17 @@ constexpr int memory_border = 5000000;
 class Memory{
     protected:
         Bit32* data;
+        unsigned int word_num; // ワード数
     public:
-        constexpr Memory(){ this->data = {}; } // 宣言するとき用
-        constexpr Memory(unsigned int size){ this->data = (Bit32*) calloc(size, sizeof(Bit32)); }
+        constexpr Memory(){ this->data = {}; this->word_num = 0; } // 宣言するとき用
+        constexpr Memory(unsigned int size){
+            this->data = (Bit32*) calloc(size, sizeof(Bit32));
+            this->word_num = size;
+        }
+        constexpr unsigned int size(){ return this->word_num; }
         constexpr Bit32 read(int w){ return this->data[w]; }
         constexpr void write(int w, const Bit32& v){ this->data[w] = v; }
+        constexpr Bit32* data_ptr(){ return this->data; } // JIT用
         void print(int start, int width){
             for(int i=start; i<start+width; ++i){
                 std::cout << "mem[" << i << "]: " << this->data[i].to_string() << std::endl;
@@ -112,9 +243,10 @@ class Memory_with_cache : public Memory{
     public:
         Cache cache;
         constexpr Memory_with_cache() = default;
-        constexpr Memory_with_cache(unsigned int size, unsigned int index_width, unsigned int offset_width){
+        constexpr Memory_with_cache(unsigned int size, unsigned int index_width, unsigned int offset_width, unsigned int way_num = cache_way_num){
             this->data = (Bit32*) calloc(size, sizeof(Bit32));
-            this->cache = Cache(index_width, offset_width);
+            this->word_num = size;
+            this->cache = Cache(index_width, offset_width, way_num);
         }
         constexpr Bit32 read(int w){
             this->cache.read(w);
@@ -127,50 +259,228 @@ class Memory_with_cache : public Memory{
 };
 
 
+/* メモリのスナップショット */
+// 0でないページだけを保持し、書き戻す際は全体を0で埋めてからそれらのページをコピーする
+inline constexpr unsigned int memory_page_size = 1024; // 1ページのワード数 (4KiB)
+class Memory_snapshot{
+    private:
+        unsigned int word_num = 0;
+        std::vector<unsigned int> page_ids;
+        std::vector<Bit32> pages;
+    public:
+        void capture(Memory& memory){
+            this->word_num = memory.size();
+            this->page_ids.clear();
+            this->pages.clear();
+            const Bit32* data = memory.data_ptr();
+            for(unsigned int start=0; start<this->word_num; start+=memory_page_size){
+                unsigned int end = std::min(start + memory_page_size, this->word_num);
+                if(std::any_of(data + start, data + end, [](const Bit32& v){ return v.ui != 0; })){
+                    this->page_ids.push_back(start / memory_page_size);
+                    this->pages.insert(this->pages.end(), data + start, data + end);
+                }
+            }
+        }
+        void restore(Memory& memory) const {
+            Bit32* data = memory.data_ptr();
+            std::memset(static_cast<void*>(data), 0, sizeof(Bit32) * this->word_num);
+            const Bit32* p = this->pages.data();
+            for(unsigned int id : this->page_ids){
+                unsigned int start = id * memory_page_size;
+                unsigned int n = std::min(memory_page_size, this->word_num - start);
+                std::memcpy(static_cast<void*>(data + start), p, sizeof(Bit32) * n);
+                p += n;
+            }
+        }
+};
+
+
 /* 送受信用のキュー */
+// single-producer/single-consumerのlock-freeなキュー (固定長のセグメントを連結したリング)
+// sim+では受信スレッド/シミュレーション本体/送信スレッドがそれぞれ片側だけを触るので、head/tailをatomicにしてロックを省く
+#ifdef EXTENDED
+inline constexpr std::memory_order queue_acquire = std::memory_order_acquire;
+inline constexpr std::memory_order queue_release = std::memory_order_release;
+#else
+// シングルスレッドのビルドでは順序の保証が不要
+inline constexpr std::memory_order queue_acquire = std::memory_order_relaxed;
+inline constexpr std::memory_order queue_release = std::memory_order_relaxed;
+#endif
+inline constexpr std::size_t cache_line_size = 64;
+
 class TransmissionQueue{
     private:
-        std::queue<Bit32> q;
-        mutable std::mutex mutex;
+        static constexpr std::size_t segment_size = 4096; // 2のべき
+        struct Segment{
+            Bit32 data[segment_size];
+            Segment* next = nullptr;
+        };
+        // 消費側 (popする側) のみが更新
+        alignas(cache_line_size) std::atomic<std::size_t> head{0};
+        Segment* head_segment;
+        // 生産側 (pushする側) のみが更新
+        alignas(cache_line_size) std::atomic<std::size_t> tail{0};
+        Segment* tail_segment;
+        #ifdef EXTENDED
+        // 消費側が待機するためのもの (wake_thresholdが0でなければ、その個数溜まった時点で起こす)
+        alignas(cache_line_size) std::atomic<std::size_t> wake_threshold{0};
+        std::mutex wait_mutex;
+        // 消費側がセグメントを解放するのと、他のスレッドからの走査(for_each)を排他する (解放はsegment_size回に1回なので、popの速度にはほぼ影響しない)
+        mutable std::mutex segment_mutex;
+        std::condition_variable cv;
+        void notify_if_waiting(){
+            std::atomic_thread_fence(std::memory_order_seq_cst); // tailの更新とwake_thresholdの読み出しを入れ替えない
+            std::size_t threshold = this->wake_threshold.load(std::memory_order_relaxed);
+            if(threshold != 0 && this->size() >= threshold){
+                std::lock_guard<std::mutex> lock(this->wait_mutex);
+                this->cv.notify_one();
+            }
+        }
+        #endif
+        void write(std::size_t t, const Bit32& v){ // 公開 (tailの更新) は呼び出し側が行う
+            if(t % segment_size == 0 && t != 0){
+                Segment* s = new Segment;
+                this->tail_segment->next = s;
+                this->tail_segment = s;
+            }
+            this->tail_segment->data[t % segment_size] = v;
+        }
+        template<class F> void for_each(std::size_t size, F f) const { // 先頭からsize個を取り出さずに走査 (生産側のスレッドから呼んでもよい)
+            #ifdef EXTENDED
+            std::lock_guard<std::mutex> lock(this->segment_mutex);
+            #endif
+            // head_segmentとheadをまたいだ更新(セグメントの境界でのpop)はロック中に完結するので、ロック中はhead_segmentが変わらず、headも次のセグメントの先頭までしか進まない
+            const Segment* s = this->head_segment;
+            std::size_t h = this->head.load(queue_acquire);
+            std::size_t t = this->tail.load(queue_acquire);
+            for(std::size_t i=h; i<t && i-h<size; ++i){
+                if(i % segment_size == 0 && i != 0) s = s->next; // headがセグメントの境界にあるとき、head_segmentはまだ1つ前のセグメント
+                f(s->data[i % segment_size]);
+            }
+        }
+        void clear(){
+            while(this->head_segment != nullptr){
+                Segment* next = this->head_segment->next;
+                delete this->head_segment;
+                this->head_segment = next;
+            }
+        }
     public:
-        TransmissionQueue() = default;
-        TransmissionQueue(const TransmissionQueue& original){
-            this->q = original.q;
+        TransmissionQueue(){
+            this->head_segment = this->tail_segment = new Segment;
+        }
+        TransmissionQueue(const TransmissionQueue& original) : TransmissionQueue(){
+            original.for_each(SIZE_MAX, [this](const Bit32& v){ this->push(v); });
         }
         TransmissionQueue& operator=(const TransmissionQueue& original){
-            TransmissionQueue copy;
-            copy.q = original.q;
-            return copy;
+            if(this != &original){
+                this->clear();
+                this->head_segment = this->tail_segment = new Segment;
+                this->head.store(0, std::memory_order_relaxed);
+                this->tail.store(0, std::memory_order_relaxed);
+                original.for_each(SIZE_MAX, [this](const Bit32& v){ this->push(v); });
+            }
+            return *this;
+        }
+        ~TransmissionQueue(){
+            this->clear();
         }
-        bool empty(){
-            std::lock_guard<std::mutex> lock(this->mutex);
-            return this->q.empty();
+        bool empty() const {
+            return this->head.load(std::memory_order_relaxed) == this->tail.load(queue_acquire);
+        }
+        std::size_t size() const {
+            return this->tail.load(queue_acquire) - this->head.load(std::memory_order_relaxed);
         }
         Bit32 pop(){
-            std::lock_guard<std::mutex> lock(this->mutex);
-            if(this->q.empty()){
+            std::size_t h = this->head.load(std::memory_order_relaxed);
+            if(h == this->tail.load(queue_acquire)){
                 std::exit(EXIT_FAILURE);
-            }else{
-                Bit32 v = this->q.front();
-                this->q.pop();
+            }
+            if(h % segment_size == 0 && h != 0){ // 生産側はすでに次のセグメントに移っているので解放してよい
+                #ifdef EXTENDED
+                std::lock_guard<std::mutex> lock(this->segment_mutex);
+                #endif
+                Segment* old = this->head_segment;
+                this->head_segment = old->next;
+                delete old;
+                Bit32 v = this->head_segment->data[0];
+                this->head.store(h + 1, queue_release); // head_segmentと同時に公開する (ロックの外で更新すると、for_eachが新しいhead_segmentと古いheadを組み合わせてしまう)
                 return v;
             }
+            Bit32 v = this->head_segment->data[h % segment_size];
+            this->head.store(h + 1, queue_release);
+            return v;
         }
         void push(const Bit32& v){
-            std::lock_guard<std::mutex> lock(this->mutex);
-            this->q.push(v);
-        }
-        void print(unsigned int size){
-            std::queue<Bit32> copy = this->q;
-            while(!copy.empty() && size > 0){
-                std::cout << copy.front().to_string() << "; ";
-                copy.pop();
-                --size;
-            }
+            std::size_t t = this->tail.load(std::memory_order_relaxed);
+            this->write(t, v);
+            this->tail.store(t + 1, queue_release);
+            #ifdef EXTENDED
+            this->notify_if_waiting();
+            #endif
+        }
+        void push(const unsigned char* data, std::size_t size){ // バイト列をまとめて追加し、最後に一度だけ公開
+            std::size_t t = this->tail.load(std::memory_order_relaxed);
+            for(std::size_t i=0; i<size; ++i) this->write(t + i, Bit32(static_cast<int>(data[i])));
+            this->tail.store(t + size, queue_release);
+            #ifdef EXTENDED
+            this->notify_if_waiting();
+            #endif
+        }
+        #ifdef EXTENDED
+        // threshold個以上溜まるか、timeoutが経過するか、is_cancelledが真になるまで眠る (消費側から呼ぶ)
+        template<class F> void wait(std::size_t threshold, std::chrono::milliseconds timeout, F is_cancelled){
+            std::unique_lock<std::mutex> lock(this->wait_mutex);
+            this->wake_threshold.store(threshold, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            this->cv.wait_for(lock, timeout, [&]{ return this->size() >= threshold || is_cancelled(); });
+            this->wake_threshold.store(0, std::memory_order_relaxed);
+        }
+        // 待機中の消費側を起こす (is_cancelledを変更した後に呼ぶ)
+        void notify(){
+            std::lock_guard<std::mutex> lock(this->wait_mutex);
+            this->cv.notify_all();
+        }
+        #endif
+        void print(unsigned int size) const {
+            this->for_each(size, [](Bit32 v){ std::cout << v.to_string() << "; "; });
             std::cout << std::endl;
         }
 };
 
+/* UART (for sim2) */
+// 受信: serverはクロック0から途切れずに送り続けると仮定し、k番目(0-indexed)のバイトは(k+1)*uart_cycles_per_byteクロック目に届く
+// 送信: stdされたバイトは容量uart_send_fifo_sizeのfifoに入り、1バイトあたりuart_cycles_per_byteクロックかけて送り出される
+class Uart{
+    public:
+        unsigned long long received_num = 0; // lrdで取り出したバイト数
+        double send_done = 0; // それまでにstdされたバイトを全て送り終えるクロック
+        unsigned long long receive_wait_count = 0; // データが未着のためにlreが空を返した回数
+        unsigned long long send_full_count = 0; // ltfがfullを返した回数
+        unsigned long long overflow_count = 0; // fifoが一杯のときにstdされた回数
+        unsigned long long receive_stall_cycles = 0; // lrdが未着のバイトを待って止まったクロック数
+        bool is_arrived(unsigned long long clk) const {
+            return static_cast<double>(this->received_num + 1) * uart_cycles_per_byte <= static_cast<double>(clk);
+        }
+        unsigned long long arrival_clk() const { // 次のバイトが届くクロック
+            return static_cast<unsigned long long>(std::ceil(static_cast<double>(this->received_num + 1) * uart_cycles_per_byte));
+        }
+        unsigned int send_fifo_num(unsigned long long clk) const {
+            double rest = this->send_done - static_cast<double>(clk);
+            return rest > 0 ? static_cast<unsigned int>(std::ceil(rest / uart_cycles_per_byte)) : 0;
+        }
+        bool is_send_full(unsigned long long clk) const {
+            return this->send_fifo_num(clk) >= uart_send_fifo_size;
+        }
+        void receive(){
+            ++this->received_num;
+        }
+        void send(unsigned long long clk){
+            if(this->is_send_full(clk)) ++this->overflow_count;
+            this->send_done = std::max(this->send_done, static_cast<double>(clk)) + uart_cycles_per_byte;
+        }
+};
+
 /* 分岐予測 */
 class Gshare{
     private:
@@ -183,6 +493,7 @@ class Gshare{
         unsigned long long correct_count;
         constexpr Gshare(unsigned int);
         constexpr void update(unsigned int, bool);
+        void copy_from(const Gshare&); // 状態を複製 (スナップショット用)
         void show_stats();
 };
 
@@ -196,6 +507,14 @@ inline constexpr Gshare::Gshare(unsigned int width){
     this->correct_count = 0;
 }
 
+inline void Gshare::copy_from(const Gshare& src){
+    this->global_history = src.global_history;
+    std::memcpy(this->branch_history_table, src.branch_history_table, sizeof(int) * (1 << this->width));
+    this->total_count = src.total_count;
+    this->taken_count = src.taken_count;
+    this->correct_count = src.correct_count;
+}
+
 inline constexpr void Gshare::update(unsigned int pc, bool taken){
     unsigned int index = (global_history ^ pc) & ((1 << this->width) - 1);
     ++total_count;
@@ -16,6 +16,14 @@ IS_IEEE=""
 IS_GSHARE=""
 IS_CACHE=""
 IS_CAUTIOUS=""
+ENGINE=""
+IS_AOT=""
+SAMPLE=""
+SAMPLE_STACK=""
+IS_CALL_GRAPH=""
+IS_CACHE_ANALYSIS=""
+IS_UNIX=""
+IS_UART=""
 while getopts 2f:bdim:srp:gc-: OPT
 do
     case $OPT in
@@ -25,7 +33,18 @@ do
                 preload) IS_PRELOADING="--preload";;
                 # boot) IS_BOOTLOADING="--boot";;
                 stat) IS_STAT="--stat";;
-                cautious) IS_CAUTIOUS="--cautious"
+                cache-analysis) IS_CACHE_ANALYSIS="--cache-analysis";;
+                cautious) IS_CAUTIOUS="--cautious";;
+                threaded) ENGINE="--engine threaded";;
+                block) ENGINE="--engine block";;
+                jit) ENGINE="--engine jit";;
+                aot) IS_AOT="--aot";;
+                sample) SAMPLE="--sample";;
+                sample-timer) SAMPLE="--sample-timer";;
+                sample-stack) SAMPLE_STACK="--sample-stack";;
+                unix) IS_UNIX="--unix";;
+                uart) IS_UART="--uart";;
+                call-graph) IS_CALL_GRAPH="--call-graph"
             esac;;
         2) IS_SECOND="2nd";;
         f) FILENAME=$OPTARG;;
@@ -59,11 +78,11 @@ cd simulator || exit 1
 
 
 if [ "${IS_SECOND}" != "" ]; then
-    rlwrap ./sim2 -f $FILENAME $IS_BIN $IS_DEBUG $IS_INFO_OUT $MEMORY $IS_IEEE $IS_PRELOADING $IS_RAYTRACING || exit 1
+    rlwrap ./sim2 -f $FILENAME $IS_BIN $IS_DEBUG $IS_INFO_OUT $MEMORY $IS_IEEE $IS_PRELOADING $IS_RAYTRACING $IS_UART $IS_CALL_GRAPH || exit 1
 else
-    if [ "$PORT" != "" -o "$IS_GSHARE" != "" -o "$IS_CACHE" != "" -o "$IS_STAT" != "" -o "$IS_CAUTIOUS" != "" ]; then
-        rlwrap ./sim+ -f $FILENAME $IS_BIN $IS_DEBUG $IS_INFO_OUT $MEMORY $IS_IEEE $IS_SKIP $IS_PRELOADING $IS_RAYTRACING $PORT $IS_BOOTLOADING $IS_GSHARE $IS_CACHE $IS_STAT $IS_CAUTIOUS || exit 1
+    if [ "$PORT" != "" -o "$IS_UNIX" != "" -o "$IS_GSHARE" != "" -o "$IS_CACHE" != "" -o "$IS_STAT" != "" -o "$IS_CAUTIOUS" != "" -o "$IS_CACHE_ANALYSIS" != "" ]; then
+        rlwrap ./sim+ -f $FILENAME $IS_BIN $IS_DEBUG $IS_INFO_OUT $MEMORY $IS_IEEE $IS_SKIP $IS_PRELOADING $IS_RAYTRACING $PORT $IS_UNIX $IS_BOOTLOADING $IS_GSHARE $IS_CACHE $IS_CACHE_ANALYSIS $IS_STAT $IS_CAUTIOUS $ENGINE $SAMPLE $SAMPLE_STACK || exit 1
     else
-        rlwrap ./sim -f $FILENAME $IS_BIN $IS_DEBUG $IS_INFO_OUT $IS_SKIP $MEMORY $IS_IEEE $IS_PRELOADING $IS_RAYTRACING || exit 1
+        rlwrap ./sim -f $FILENAME $IS_BIN $IS_DEBUG $IS_INFO_OUT $IS_SKIP $MEMORY $IS_IEEE $IS_PRELOADING $IS_RAYTRACING $ENGINE $IS_AOT $SAMPLE $SAMPLE_STACK || exit 1
     fi
 fi